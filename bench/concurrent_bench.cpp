@@ -0,0 +1,144 @@
+// Contention benchmark: ConcurrentBorrowChecker, ShardedBorrowChecker and the
+// per-element words of BorrowVec against the v2 BorrowChecker behind
+// borrow::LockedChecker, at 1 to 64 threads. Each thread runs the same number
+// of borrow/release iterations; the table shows wall-clock ns per iteration.
+// ShardedBorrowChecker doesn't check borrows of one value from several
+// threads, so it sits out the shared-ref workload.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "../borrow.h"
+#include "../borrow_vec.h"
+#include "../concurrent_checker.h"
+#include "../sharded_checker.h"
+
+enum class Workload { SharedRef, PrivateRef, PrivateMut };
+
+const char *workload_name(Workload workload) {
+  switch (workload) {
+  case Workload::SharedRef:
+    return "shared-ref";
+  case Workload::PrivateRef:
+    return "private-ref";
+  case Workload::PrivateMut:
+    return "private-mut";
+  }
+  return "";
+}
+
+template <typename Checker>
+double run(Workload workload, int threads, std::size_t iterations) {
+  Checker checker;
+  // Space the objects a cache line apart so only the checker is contended.
+  std::vector<long> objects(static_cast<std::size_t>(threads) * 8, 1);
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::atomic<long> sink{0};
+
+  auto body = [&](int id) {
+    long *object = workload == Workload::SharedRef ? &objects[0]
+                                                   : &objects[id * 8];
+    long sum = 0;
+    ready.fetch_add(1);
+    while (!go.load(std::memory_order_acquire)) {
+    }
+    for (std::size_t i = 0; i < iterations; ++i) {
+      if (workload == Workload::PrivateMut) {
+        MutableRef<long, Checker> ref(object, &checker);
+        sum += *ref;
+      } else {
+        Ref<long, Checker> ref(object, &checker);
+        sum += *ref;
+      }
+    }
+    sink.fetch_add(sum);
+  };
+
+  std::vector<std::thread> workers;
+  for (int id = 0; id < threads; ++id) {
+    workers.emplace_back(body, id);
+  }
+  while (ready.load() != threads) {
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         static_cast<double>(iterations);
+}
+
+// Same workloads with the objects in a BorrowVec, borrowed through their own
+// words rather than a checker.
+double run_vec(Workload workload, int threads, std::size_t iterations) {
+  BorrowVec<long> objects(static_cast<std::size_t>(threads) * 8, 1);
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::atomic<long> sink{0};
+
+  auto body = [&](int id) {
+    std::size_t index = workload == Workload::SharedRef
+                            ? 0
+                            : static_cast<std::size_t>(id) * 8;
+    long sum = 0;
+    ready.fetch_add(1);
+    while (!go.load(std::memory_order_acquire)) {
+    }
+    for (std::size_t i = 0; i < iterations; ++i) {
+      if (workload == Workload::PrivateMut) {
+        sum += *objects.borrow_mut(index);
+      } else {
+        sum += *objects.borrow(index);
+      }
+    }
+    sink.fetch_add(sum);
+  };
+
+  std::vector<std::thread> workers;
+  for (int id = 0; id < threads; ++id) {
+    workers.emplace_back(body, id);
+  }
+  while (ready.load() != threads) {
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         static_cast<double>(iterations);
+}
+
+int main(int argc, char **argv) {
+  std::size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                                    : 200000;
+  std::printf("%-12s %8s %14s %14s %14s %14s\n", "workload", "threads",
+              "mutex ns/op", "atomic ns/op", "sharded ns/op", "vec ns/op");
+  for (Workload workload :
+       {Workload::SharedRef, Workload::PrivateRef, Workload::PrivateMut}) {
+    for (int threads = 1; threads <= 64; threads *= 2) {
+      double locked = run<borrow::LockedChecker<BorrowChecker>>(
+          workload, threads, iterations);
+      double atomic =
+          run<ConcurrentBorrowChecker>(workload, threads, iterations);
+      std::printf("%-12s %8d %14.1f %14.1f", workload_name(workload), threads,
+                  locked, atomic);
+      if (workload == Workload::SharedRef) {
+        std::printf(" %14s", "-");
+      } else {
+        double sharded =
+            run<ShardedBorrowChecker>(workload, threads, iterations);
+        std::printf(" %14.1f", sharded);
+      }
+      std::printf(" %14.1f\n", run_vec(workload, threads, iterations));
+    }
+  }
+  return 0;
+}
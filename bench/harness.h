@@ -0,0 +1,109 @@
+#pragma once
+
+// Self-contained micro-benchmark harness for the bench/suite_* programs. Each
+// benchmark is a callable performing one operation; the harness doubles the
+// batch size until a batch runs for at least the minimum time and reports the
+// mean cost per operation. Results are printed as one JSON object per suite.
+// The standalone benchmarks time fixed round counts with ns_per_op().
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Keeps the compiler from discarding a value or hoisting work out of a loop.
+template <typename T> inline void do_not_optimize(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Cost of one operation when each call of round performs per_round of them:
+// round runs once to warm up, then in batches of rounds calls, and the best
+// batch is kept so that a stray preemption or frequency change in one batch
+// doesn't skew the comparison between variants.
+template <typename F>
+double ns_per_op(std::size_t rounds, std::size_t per_round, F &&round) {
+  constexpr int kBatches = 7;
+  round();
+  double best = 0;
+  for (int batch = 0; batch < kBatches; ++batch) {
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < rounds; ++i) {
+      round();
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (batch == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best / static_cast<double>(rounds * per_round);
+}
+
+struct BenchResult {
+  std::string name;
+  std::size_t live;
+  std::uint64_t iterations;
+  double ns_per_op;
+};
+
+class BenchSuite {
+private:
+  const char *generation_;
+  double min_time_ns_ = 100e6;
+  std::vector<BenchResult> results_;
+
+public:
+  // Accepts --min-time-ms=N to trade precision for run time.
+  BenchSuite(const char *generation, int argc, char **argv)
+      : generation_(generation) {
+    for (int i = 1; i < argc; ++i) {
+      const char *flag = "--min-time-ms=";
+      if (std::strncmp(argv[i], flag, std::strlen(flag)) == 0) {
+        min_time_ns_ = std::strtod(argv[i] + std::strlen(flag), nullptr) * 1e6;
+      }
+    }
+  }
+
+  // live is the number of borrows held in the checker while op runs.
+  template <typename F> void run(const char *name, std::size_t live, F &&op) {
+    op();
+    for (std::uint64_t iterations = 1;; iterations *= 2) {
+      auto start = std::chrono::steady_clock::now();
+      for (std::uint64_t i = 0; i < iterations; ++i) {
+        op();
+      }
+      double elapsed = std::chrono::duration<double, std::nano>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      if (elapsed >= min_time_ns_ || iterations >= (std::uint64_t{1} << 40)) {
+        results_.push_back({name, live, iterations,
+                            elapsed / static_cast<double>(iterations)});
+        return;
+      }
+    }
+  }
+
+  void print_json(std::FILE *out) const {
+    std::fprintf(out, "{\"generation\": \"%s\", \"results\": [", generation_);
+    for (std::size_t i = 0; i < results_.size(); ++i) {
+      const BenchResult &result = results_[i];
+      std::fprintf(out,
+                   "%s\n  {\"name\": \"%s\", \"live\": %zu, "
+                   "\"iterations\": %llu, \"ns_per_op\": %.3f}",
+                   i == 0 ? "" : ",", result.name.c_str(), result.live,
+                   static_cast<unsigned long long>(result.iterations),
+                   result.ns_per_op);
+    }
+    std::fprintf(out, "\n]}\n");
+  }
+};
+
+// Live-borrow counts every suite is measured at.
+constexpr std::size_t kLiveCounts[] = {1, 64, 10000, 1000000};
+
+// Borrows created and dropped together by the churn benchmarks.
+constexpr std::size_t kChurnBatch = 64;
@@ -0,0 +1,46 @@
+// Cost of creating, borrowing once and dropping an owned value: Own over
+// new/delete, Own from a pool through allocate_own, and make_own's InlineOwn,
+// which does not allocate the value at all.
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+
+#include "../v2.h"
+#include "harness.h"
+
+struct Payload {
+  long a;
+  long b;
+};
+
+int main(int argc, char **argv) {
+  std::size_t rounds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 300000;
+  FlatBorrowChecker checker;
+  long sum = 0;
+
+  double heap = ns_per_op(rounds, 1, [&] {
+    Own<Payload, FlatBorrowChecker> own(new Payload{1, 2}, &checker);
+    Ref<Payload, FlatBorrowChecker> ref(own.get(), &checker);
+    sum += ref->a + ref->b;
+  });
+
+  std::pmr::unsynchronized_pool_resource pool;
+  std::pmr::polymorphic_allocator<Payload> alloc(&pool);
+  double pooled = ns_per_op(rounds, 1, [&] {
+    auto own = allocate_own<Payload>(alloc, &checker, Payload{1, 2});
+    Ref<Payload, FlatBorrowChecker> ref(own.get(), &checker);
+    sum += ref->a + ref->b;
+  });
+
+  double inline_own = ns_per_op(rounds, 1, [&] {
+    auto own = make_own<Payload>(&checker, Payload{1, 2});
+    Ref<Payload, FlatBorrowChecker> ref(own.get(), &checker);
+    sum += ref->a + ref->b;
+  });
+
+  std::printf("%-32s %10s\n", "storage", "ns/own");
+  std::printf("%-32s %10.2f\n", "Own (new/delete)", heap);
+  std::printf("%-32s %10.2f\n", "allocate_own (pool resource)", pooled);
+  std::printf("%-32s %10.2f\n", "make_own (inline)", inline_own);
+  return sum == 0;
+}
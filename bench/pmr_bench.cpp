@@ -0,0 +1,57 @@
+// Borrow churn inside simulated request handlers: each request builds a
+// checker, borrows a batch of distinct objects and drops them again. Compares
+// the malloc-backed node map with PmrBorrowChecker on a shared pool resource
+// and on a per-request monotonic arena.
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <vector>
+
+#include "../v2.h"
+#include "harness.h"
+
+constexpr std::size_t kBorrowsPerRequest = 64;
+
+template <typename Checker>
+void handle_request(Checker &checker, std::vector<int> &objects, long &sum) {
+  std::vector<Ref<int, Checker>> refs;
+  refs.reserve(kBorrowsPerRequest);
+  for (std::size_t i = 0; i < kBorrowsPerRequest; ++i) {
+    refs.emplace_back(&objects[i], &checker);
+  }
+  for (Ref<int, Checker> &ref : refs) {
+    sum += *ref;
+  }
+}
+
+int main(int argc, char **argv) {
+  std::size_t requests = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 8000;
+  std::vector<int> objects(kBorrowsPerRequest, 1);
+  long sum = 0;
+
+  double node = ns_per_op(requests, kBorrowsPerRequest, [&] {
+    BorrowChecker checker;
+    handle_request(checker, objects, sum);
+  });
+
+  std::pmr::unsynchronized_pool_resource pool;
+  double pooled = ns_per_op(requests, kBorrowsPerRequest, [&] {
+    PmrBorrowChecker checker(&pool);
+    handle_request(checker, objects, sum);
+  });
+
+  double arena = ns_per_op(requests, kBorrowsPerRequest, [&] {
+    std::array<std::byte, 16 * 1024> buffer;
+    std::pmr::monotonic_buffer_resource request_arena(
+        buffer.data(), buffer.size(), std::pmr::null_memory_resource());
+    PmrBorrowChecker checker(&request_arena);
+    handle_request(checker, objects, sum);
+  });
+
+  std::printf("%-32s %10s\n", "backing", "ns/borrow");
+  std::printf("%-32s %10.2f\n", "malloc (BorrowChecker)", node);
+  std::printf("%-32s %10.2f\n", "unsynchronized_pool_resource", pooled);
+  std::printf("%-32s %10.2f\n", "per-request monotonic arena", arena);
+  return sum == 0;
+}
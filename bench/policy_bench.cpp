@@ -0,0 +1,80 @@
+// Cost of the v2 wrappers under each CheckPolicy against a raw pointer. Every
+// element of an array is read through a freshly constructed borrow; with
+// CheckPolicy::None the wrappers inline away and the loop compiles to the
+// same code as the raw-pointer one (make report lists any that don't). The
+// sampled rows check a fraction of the elements through SampledBorrowChecker.
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../sampled_checker.h"
+#include "../v2.h"
+#include "harness.h"
+
+template <typename Checker, typename Policy, typename... Args>
+double ref_loop(std::vector<int> &data, std::size_t rounds, Args... args) {
+  Checker checker(args...);
+  return ns_per_op(rounds, data.size(), [&] {
+    long sum = 0;
+    for (int &item : data) {
+      Ref<int, Checker, Policy> ref(&item, &checker);
+      sum += *ref;
+    }
+    do_not_optimize(sum);
+  });
+}
+
+template <typename Checker, typename Policy, typename... Args>
+double mut_loop(std::vector<int> &data, std::size_t rounds, Args... args) {
+  Checker checker(args...);
+  return ns_per_op(rounds, data.size(), [&] {
+    for (int &item : data) {
+      MutableRef<int, Checker, Policy> ref(&item, &checker);
+      *ref += 1;
+    }
+    do_not_optimize(data);
+  });
+}
+
+int main(int argc, char **argv) {
+  std::size_t rounds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 300;
+  std::vector<int> data(4096, 1);
+
+  double raw_read = ns_per_op(rounds, data.size(), [&] {
+    long sum = 0;
+    for (int &item : data) {
+      int *ptr = &item;
+      sum += *ptr;
+    }
+    do_not_optimize(sum);
+  });
+  double raw_write = ns_per_op(rounds, data.size(), [&] {
+    for (int &item : data) {
+      int *ptr = &item;
+      *ptr += 1;
+    }
+    do_not_optimize(data);
+  });
+
+  std::printf("%-28s %10s %10s\n", "variant", "read ns", "write ns");
+  std::printf("%-28s %10.3f %10.3f\n", "raw pointer", raw_read, raw_write);
+  std::printf("%-28s %10.3f %10.3f\n", "CheckPolicy::None",
+              ref_loop<BorrowChecker, CheckPolicy::None>(data, rounds),
+              mut_loop<BorrowChecker, CheckPolicy::None>(data, rounds));
+  std::printf("%-28s %10.3f %10.3f\n", "CheckPolicy::Full (flat)",
+              ref_loop<FlatBorrowChecker, CheckPolicy::Full>(data, rounds),
+              mut_loop<FlatBorrowChecker, CheckPolicy::Full>(data, rounds));
+  std::printf("%-28s %10.3f %10.3f\n", "CheckPolicy::Full (node)",
+              ref_loop<BorrowChecker, CheckPolicy::Full>(data, rounds),
+              mut_loop<BorrowChecker, CheckPolicy::Full>(data, rounds));
+  for (double rate : {1.0 / 64, 1.0 / 8}) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "sampled 1/%.0f (flat)", 1 / rate);
+    std::printf("%-28s %10.3f %10.3f\n", name,
+                ref_loop<SampledBorrowChecker<>, CheckPolicy::Full>(
+                    data, rounds, rate),
+                mut_loop<SampledBorrowChecker<>, CheckPolicy::Full>(
+                    data, rounds, rate));
+  }
+  return 0;
+}
@@ -0,0 +1,42 @@
+// Cost of a request handler that borrows N values and drops them together:
+// N Refs, each releasing its borrow on destruction, against N borrows taken
+// in a BorrowScope and released by closing it.
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "../scope_checker.h"
+#include "harness.h"
+
+int main(int argc, char **argv) {
+  std::size_t rounds = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+  std::size_t n = 64;
+  std::vector<long> values(n, 1);
+  long sum = 0;
+
+  FlatBorrowChecker flat;
+  // Allocated once so the rounds only time the borrows and their release.
+  std::vector<Ref<long, FlatBorrowChecker>> held;
+  held.reserve(n);
+  double refs = ns_per_op(rounds, n, [&] {
+    for (long &value : values) {
+      held.emplace_back(&value, &flat);
+      sum += *held.back();
+    }
+    held.clear();
+  });
+
+  ScopedBorrowChecker<> scoped;
+  double scope = ns_per_op(rounds, n, [&] {
+    BorrowScope<ScopedBorrowChecker<>> borrows(&scoped);
+    for (long &value : values) {
+      sum += borrows.borrow(&value);
+    }
+  });
+
+  std::printf("%-32s %10s\n", "release", "ns/borrow");
+  std::printf("%-32s %10.2f\n", "Ref per value", refs);
+  std::printf("%-32s %10.2f\n", "BorrowScope", scope);
+  return sum == 0;
+}
@@ -0,0 +1,65 @@
+// Wrapper and checker costs for v1.h. See harness.h for the output format.
+#include <vector>
+
+#include "../v1.h"
+#include "harness.h"
+
+using namespace v1;
+
+int main(int argc, char **argv) {
+  BenchSuite suite("v1", argc, argv);
+  for (std::size_t live : kLiveCounts) {
+    BorrowChecker checker;
+    // objects[0, live) are held borrowed; the rest start untracked.
+    std::vector<long> objects(live + kChurnBatch + 2, 1);
+    for (std::size_t i = 0; i < live; ++i) {
+      checker.add_borrow(&objects[i], BorrowState::Valid);
+    }
+    long *held = &objects[0];
+    long *fresh = &objects[live];
+
+    suite.run("ref", live, [&] {
+      Ref<long> ref(fresh, &checker);
+      do_not_optimize(*ref);
+    });
+    suite.run("ref_shared", live, [&] {
+      Ref<long> ref(held, &checker);
+      do_not_optimize(*ref);
+    });
+    suite.run("mutable_ref", live, [&] {
+      MutableRef<long> ref(fresh, &checker);
+      do_not_optimize(*ref);
+    });
+    suite.run("check_hit", live,
+              [&] { do_not_optimize(checker.check_borrow(held)); });
+    suite.run("check_miss", live,
+              [&] { do_not_optimize(checker.check_borrow(fresh)); });
+    {
+      Ref<long> src(fresh, &checker);
+      Ref<long> dst(&objects[live + 1], &checker);
+      suite.run("ref_copy_assign", live, [&] {
+        dst = src;
+        do_not_optimize(*dst);
+      });
+    }
+    {
+      // Two moves per op; v1 moves only copy the pointers.
+      Ref<long> slot(fresh, &checker);
+      suite.run("ref_move", live, [&] {
+        Ref<long> moved(std::move(slot));
+        slot = std::move(moved);
+        do_not_optimize(*slot);
+      });
+    }
+    suite.run("churn", live, [&] {
+      std::vector<Ref<long>> refs;
+      refs.reserve(kChurnBatch);
+      for (std::size_t i = 0; i < kChurnBatch; ++i) {
+        refs.emplace_back(&objects[live + 2 + i], &checker);
+      }
+      do_not_optimize(refs.data());
+    });
+  }
+  suite.print_json(stdout);
+  return 0;
+}
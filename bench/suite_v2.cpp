@@ -0,0 +1,95 @@
+// Wrapper and checker costs for v2.h, for the node-based and flat storage
+// backends, SlotBorrowChecker, EpochBorrowChecker and LazyBorrowChecker. See
+// harness.h for the output format.
+#include <cstdio>
+#include <vector>
+
+#include "../epoch_checker.h"
+#include "../lazy_checker.h"
+#include "../slot_checker.h"
+#include "../v2.h"
+#include "harness.h"
+
+template <typename Checker> void run_suite(BenchSuite &suite) {
+  for (std::size_t live : kLiveCounts) {
+    Checker checker;
+    // objects[0, live) are held borrowed; the rest start untracked.
+    std::vector<long> objects(live + kChurnBatch + 2, 1);
+    for (std::size_t i = 0; i < live; ++i) {
+      checker.add_borrow(&objects[i], BorrowState::Valid);
+    }
+    long *held = &objects[0];
+    long *fresh = &objects[live];
+
+    suite.run("ref", live, [&] {
+      Ref<long, Checker> ref(fresh, &checker);
+      do_not_optimize(*ref);
+    });
+    suite.run("ref_shared", live, [&] {
+      Ref<long, Checker> ref(held, &checker);
+      do_not_optimize(*ref);
+    });
+    suite.run("mutable_ref", live, [&] {
+      MutableRef<long, Checker> ref(fresh, &checker);
+      do_not_optimize(*ref);
+    });
+    // Includes the new/delete of the owned value.
+    suite.run("own", live, [&] {
+      Own<long, Checker> own(new long(1), &checker);
+      do_not_optimize(*own);
+    });
+    suite.run("check_hit", live,
+              [&] { do_not_optimize(checker.check_borrow(held)); });
+    suite.run("check_miss", live,
+              [&] { do_not_optimize(checker.check_borrow(fresh)); });
+    {
+      Ref<long, Checker> dst(&objects[live + 1], &checker);
+      suite.run("ref_move_assign", live, [&] {
+        Ref<long, Checker> src(fresh, &checker);
+        dst = std::move(src);
+        do_not_optimize(*dst);
+      });
+    }
+    {
+      // Two moves per op; the pointer and release token are copied, the
+      // record stays as it is.
+      Ref<long, Checker> slot(fresh, &checker);
+      suite.run("ref_move", live, [&] {
+        Ref<long, Checker> moved(std::move(slot));
+        slot = std::move(moved);
+        do_not_optimize(*slot);
+      });
+    }
+    suite.run("churn", live, [&] {
+      std::vector<Ref<long, Checker>> refs;
+      refs.reserve(kChurnBatch);
+      for (std::size_t i = 0; i < kChurnBatch; ++i) {
+        refs.emplace_back(&objects[live + 2 + i], &checker);
+      }
+      do_not_optimize(refs.data());
+    });
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchSuite node("v2", argc, argv);
+  run_suite<BorrowChecker>(node);
+  node.print_json(stdout);
+  std::printf(",\n");
+  BenchSuite flat("v2-flat", argc, argv);
+  run_suite<FlatBorrowChecker>(flat);
+  flat.print_json(stdout);
+  std::printf(",\n");
+  BenchSuite slot("v2-slot", argc, argv);
+  run_suite<SlotBorrowChecker>(slot);
+  slot.print_json(stdout);
+  std::printf(",\n");
+  BenchSuite epoch("v2-epoch", argc, argv);
+  run_suite<EpochBorrowChecker<>>(epoch);
+  epoch.print_json(stdout);
+  std::printf(",\n");
+  BenchSuite lazy("v2-lazy", argc, argv);
+  run_suite<LazyBorrowChecker<>>(lazy);
+  lazy.print_json(stdout);
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Wrapper and checker costs for version3.h. "v3" uses 64 inline slots, so
+// larger live counts run through the spill table; "v3-inline" sizes the
+// inline array to the live count and is skipped at 1M, where populating the
+// linear slot array alone would take minutes. "v3-inline-interleaved" repeats
+// it with the {address, record} slot layout. See harness.h for the output
+// format.
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "../version3.h"
+#include "harness.h"
+
+using namespace v3;
+
+template <std::size_t N, typename Layout = SlotLayout::Split>
+void run_live(BenchSuite &suite, std::size_t live) {
+  using Checker = BorrowChecker<long, N, Layout>;
+  auto checker = std::make_unique<Checker>();
+  // objects[0, live) are held borrowed; the rest start untracked.
+  std::vector<long> objects(live + kChurnBatch + 2, 1);
+  for (std::size_t i = 0; i < live; ++i) {
+    checker->add_borrow(&objects[i], BorrowState::Valid);
+  }
+  long *held = &objects[0];
+  long *fresh = &objects[live];
+
+  suite.run("ref", live, [&] {
+    Ref<long, N, Layout> ref(fresh, checker.get());
+    do_not_optimize(*ref);
+  });
+  suite.run("ref_shared", live, [&] {
+    Ref<long, N, Layout> ref(held, checker.get());
+    do_not_optimize(*ref);
+  });
+  // Includes the new/delete of the owned value.
+  suite.run("own", live, [&] {
+    Own<long, N, std::default_delete<long>, Layout> own(new long(1),
+                                                        checker.get());
+    do_not_optimize(*own);
+  });
+  suite.run("check_hit", live,
+            [&] { do_not_optimize(checker->check_borrow(held)); });
+  suite.run("check_miss", live,
+            [&] { do_not_optimize(checker->check_borrow(fresh)); });
+  {
+    Ref<long, N, Layout> dst(&objects[live + 1], checker.get());
+    suite.run("ref_move_assign", live, [&] {
+      Ref<long, N, Layout> src(fresh, checker.get());
+      dst = std::move(src);
+      do_not_optimize(*dst);
+    });
+  }
+  {
+    // Two moves per op; the borrow keeps its slot and nothing is looked up.
+    Ref<long, N, Layout> slot(fresh, checker.get());
+    suite.run("ref_move", live, [&] {
+      Ref<long, N, Layout> moved(std::move(slot));
+      slot = std::move(moved);
+      do_not_optimize(*slot);
+    });
+  }
+  suite.run("churn", live, [&] {
+    std::vector<Ref<long, N, Layout>> refs;
+    refs.reserve(kChurnBatch);
+    for (std::size_t i = 0; i < kChurnBatch; ++i) {
+      refs.emplace_back(&objects[live + 2 + i], checker.get());
+    }
+    do_not_optimize(refs.data());
+  });
+}
+
+int main(int argc, char **argv) {
+  BenchSuite spill("v3", argc, argv);
+  for (std::size_t live : kLiveCounts) {
+    run_live<64>(spill, live);
+  }
+  {
+    // MutableRef is tied to a single-slot checker.
+    BorrowChecker<long, 1> checker;
+    long value = 1;
+    spill.run("mutable_ref", 1, [&] {
+      MutableRef<long> ref(value, checker);
+      do_not_optimize(*ref);
+    });
+  }
+  spill.print_json(stdout);
+  std::printf(",\n");
+  BenchSuite inline_slots("v3-inline", argc, argv);
+  run_live<1 + kChurnBatch + 2>(inline_slots, 1);
+  run_live<64 + kChurnBatch + 2>(inline_slots, 64);
+  run_live<10000 + kChurnBatch + 2>(inline_slots, 10000);
+  inline_slots.print_json(stdout);
+  std::printf(",\n");
+  BenchSuite interleaved("v3-inline-interleaved", argc, argv);
+  run_live<1 + kChurnBatch + 2, SlotLayout::Interleaved>(interleaved, 1);
+  run_live<64 + kChurnBatch + 2, SlotLayout::Interleaved>(interleaved, 64);
+  run_live<10000 + kChurnBatch + 2, SlotLayout::Interleaved>(interleaved,
+                                                             10000);
+  interleaved.print_json(stdout);
+  return 0;
+}
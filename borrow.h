@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+#include "borrowable.h"
+#include "concurrent_checker.h"
+#include "sharded_checker.h"
+#include "v2.h"
+
+// Single entry point to the borrow checker. One engine, the v2 wrappers, is
+// configured at compile time by three policies:
+//
+//   StoragePolicy  where records live: node or flat hash map, pmr map, a
+//                  fixed inline array, or intrusively next to each value;
+//   ThreadPolicy   how a checker may be shared: one thread, behind a mutex,
+//                  lock-free atomic words, or per-thread shards;
+//   CheckPolicy    how much is checked: Full, None or DebugOnly.
+//
+// Each subsystem picks its own configuration and gets matching types:
+//
+//   using Net = borrow::Engine<borrow::StoragePolicy::Flat,
+//                              borrow::ThreadPolicy::Atomic>;
+//   Net::Checker checker;
+//   Net::Ref<Conn> conn(&c, &checker);
+//
+// The engine and every checker header it builds on define their names in
+// namespace borrow. For code written before the namespace, they also declare
+// those names at global scope; define BORROW_NO_GLOBAL_NAMES to leave the
+// global names out. v1.h and version3.h keep their own types in namespaces
+// v1 and v3 and can be included next to this header.
+namespace borrow {
+
+namespace StoragePolicy {
+using Node = NodeStorage;
+using Flat = FlatStorage;
+using Pmr = PmrStorage;
+template <std::size_t N> using Fixed = FixedStorage<N>;
+// Every value carries its own record as a Borrowable<T>; no shared checker.
+struct Intrusive {};
+} // namespace StoragePolicy
+
+namespace ThreadPolicy {
+struct Single {};
+struct Locked {};
+// ConcurrentBorrowChecker; it has its own fixed index, so the storage must be
+// left at the default, Flat.
+struct Atomic {};
+// ShardedBorrowChecker; per-thread flat tables, so likewise Flat.
+struct Sharded {};
+} // namespace ThreadPolicy
+
+// Any checker behind one mutex, so it can be shared between threads.
+template <typename Checker> class LockedChecker {
+private:
+  mutable std::mutex mutex_;
+  Checker checker_;
+
+public:
+  LockedChecker() = default;
+
+  LockedChecker(const LockedChecker &) = delete;
+  LockedChecker &operator=(const LockedChecker &) = delete;
+
+  void add_borrow(void *ptr, BorrowState state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checker_.add_borrow(ptr, state);
+  }
+
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return checker_.try_add_borrow(ptr, state);
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checker_.remove_borrow(ptr, state);
+  }
+
+  void remove_borrow(void *ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checker_.remove_borrow(ptr);
+  }
+
+  BorrowState check_borrow(void *ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return checker_.check_borrow(ptr);
+  }
+
+  std::uint32_t shared_count(void *ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return checker_.shared_count(ptr);
+  }
+
+  void set_owned(void *ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checker_.set_owned(ptr);
+  }
+
+  bool check_owned(void *ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return checker_.check_owned(ptr);
+  }
+};
+
+// The checker class for a storage and threading policy.
+template <typename Storage, typename Threading> struct checker_for;
+
+template <typename Storage>
+struct checker_for<Storage, ThreadPolicy::Single> {
+  using type = BasicBorrowChecker<Storage>;
+};
+
+template <typename Storage>
+struct checker_for<Storage, ThreadPolicy::Locked> {
+  using type = LockedChecker<BasicBorrowChecker<Storage>>;
+};
+
+template <typename Storage>
+struct checker_for<Storage, ThreadPolicy::Atomic> {
+  static_assert(std::is_same_v<Storage, StoragePolicy::Flat>,
+                "ConcurrentBorrowChecker has its own storage");
+  using type = ConcurrentBorrowChecker;
+};
+
+template <typename Storage>
+struct checker_for<Storage, ThreadPolicy::Sharded> {
+  static_assert(std::is_same_v<Storage, StoragePolicy::Flat>,
+                "ShardedBorrowChecker has its own storage");
+  using type = ShardedBorrowChecker;
+};
+
+template <typename Storage = StoragePolicy::Flat,
+          typename Threading = ThreadPolicy::Single,
+          typename Check = CheckPolicy::Full>
+struct Engine {
+  using Checker = typename checker_for<Storage, Threading>::type;
+
+  template <typename T> using Ref = borrow::Ref<T, Checker, Check>;
+
+  template <typename T>
+  using MutableRef = borrow::MutableRef<T, Checker, Check>;
+
+  template <typename T, typename Deleter = std::default_delete<T>>
+  using Own = borrow::Own<T, Checker, Check, Deleter>;
+
+  template <typename T> using InlineOwn = borrow::InlineOwn<T, Checker, Check>;
+};
+
+// Intrusive storage has no shared checker: a Borrowable<T> is its own
+// checker, and the wrappers for T are bound to it.
+template <typename Threading, typename Check>
+struct Engine<StoragePolicy::Intrusive, Threading, Check> {
+  static_assert(std::is_same_v<Threading, ThreadPolicy::Single>,
+                "intrusive records are not synchronised");
+
+  template <typename T> using Value = Borrowable<T>;
+
+  template <typename T> using Ref = borrow::Ref<T, Borrowable<T>, Check>;
+
+  template <typename T>
+  using MutableRef = borrow::MutableRef<T, Borrowable<T>, Check>;
+};
+
+static_assert(std::is_same_v<Engine<>::Ref<int>, Ref<int, FlatBorrowChecker>>,
+              "the default engine is the flat single-threaded checker");
+static_assert(sizeof(Engine<StoragePolicy::Flat, ThreadPolicy::Single,
+                            CheckPolicy::None>::Ref<int>) == sizeof(int *),
+              "unchecked engines keep bare pointers");
+
+} // namespace borrow
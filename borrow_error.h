@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace borrow {
+
+// Reports a misuse that isn't a refused borrow, such as a second owner for an
+// Own, a full fixed-size table or an unwritable trace file: throws E with the
+// message, or prints it and aborts when built without exceptions. Refused
+// borrows go through fail_borrow() in borrow_result.h instead.
+template <typename E = std::runtime_error>
+[[noreturn]] inline void borrow_error(const char *message) {
+#if defined(__cpp_exceptions)
+  throw E(message);
+#else
+  std::fprintf(stderr, "borrow error: %s\n", message);
+  std::abort();
+#endif
+}
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::borrow_error;
+#endif
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "borrow_error.h"
+
+namespace borrow {
+
+// What the v2 and v3 wrappers report when a borrow is refused, and what they
+// do with it: the failure handler behind the throwing constructors and the
+// BorrowResult returned by the try_* functions.
+
+enum class BorrowState { Valid, Invalid, MutableBorrowed, Owned };
+
+// Why a borrow was refused.
+enum class BorrowErrc : std::uint8_t {
+  // A shared borrow of a value that is mutably borrowed.
+  SharedWhileMutable,
+  // An exclusive borrow of a value that is already borrowed.
+  MutableWhileBorrowed,
+};
+
+// A refused borrow: what went wrong and the borrow that was already held.
+// held is Invalid when the checker can't report it.
+struct BorrowConflict {
+  BorrowErrc code;
+  BorrowState held;
+
+  const char *message() const {
+    return code == BorrowErrc::SharedWhileMutable
+               ? "cannot borrow as immutable because it is also borrowed as "
+                 "mutable"
+               : "cannot borrow as mutable more than once, already borrowed";
+  }
+};
+
+// What the throwing constructors do with a refused borrow. A handler must
+// not return: it throws, aborts or otherwise leaves the scope; if it does
+// return, the program is aborted.
+using BorrowFailureHandler = void (*)(const BorrowConflict &);
+
+// Prints the conflict to stderr and aborts.
+[[noreturn]] inline void
+abort_on_borrow_failure(const BorrowConflict &conflict) {
+  std::fprintf(stderr, "borrow conflict: %s\n", conflict.message());
+  std::abort();
+}
+
+// Throws std::runtime_error with the conflict's message: the default, and
+// the behaviour the wrappers have always had. Aborts instead when built
+// without exceptions.
+[[noreturn]] inline void
+throw_on_borrow_failure(const BorrowConflict &conflict) {
+#if defined(__cpp_exceptions)
+  throw std::runtime_error(conflict.message());
+#else
+  abort_on_borrow_failure(conflict);
+#endif
+}
+
+inline std::atomic<BorrowFailureHandler> &borrow_failure_handler() {
+  static std::atomic<BorrowFailureHandler> handler{&throw_on_borrow_failure};
+  return handler;
+}
+
+// Installs handler for every thread and returns the one it replaces.
+inline BorrowFailureHandler
+set_borrow_failure_handler(BorrowFailureHandler handler) {
+  return borrow_failure_handler().exchange(handler, std::memory_order_acq_rel);
+}
+
+[[noreturn]] inline void fail_borrow(const BorrowConflict &conflict) {
+  borrow_failure_handler().load(std::memory_order_acquire)(conflict);
+  std::abort();
+}
+
+// Either a borrow or the conflict that stopped it, as returned by
+// try_borrow() and try_borrow_mut(). Like std::expected, value() on a
+// conflict is an error; it goes to the failure handler.
+template <typename T> class BorrowResult {
+private:
+  union {
+    T value_;
+    BorrowConflict conflict_;
+  };
+  bool ok_;
+
+public:
+  BorrowResult(T &&value) : value_(std::move(value)), ok_(true) {}
+
+  BorrowResult(BorrowConflict conflict) : conflict_(conflict), ok_(false) {}
+
+  BorrowResult(const BorrowResult &) = delete;
+  BorrowResult &operator=(const BorrowResult &) = delete;
+
+  BorrowResult(BorrowResult &&other) noexcept : ok_(other.ok_) {
+    if (ok_) {
+      new (&value_) T(std::move(other.value_));
+    } else {
+      new (&conflict_) BorrowConflict(other.conflict_);
+    }
+  }
+
+  ~BorrowResult() {
+    if (ok_) {
+      value_.~T();
+    }
+  }
+
+  bool has_value() const { return ok_; }
+
+  explicit operator bool() const { return ok_; }
+
+  T &value() & {
+    if (!ok_) {
+      fail_borrow(conflict_);
+    }
+    return value_;
+  }
+
+  T &&value() && { return std::move(value()); }
+
+  T &operator*() & { return value_; }
+
+  T *operator->() { return &value_; }
+
+  // Only meaningful when has_value() is false.
+  const BorrowConflict &error() const { return conflict_; }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::BorrowState;
+using borrow::BorrowErrc;
+using borrow::BorrowConflict;
+using borrow::BorrowFailureHandler;
+using borrow::abort_on_borrow_failure;
+using borrow::throw_on_borrow_failure;
+using borrow::borrow_failure_handler;
+using borrow::set_borrow_failure_handler;
+using borrow::fail_borrow;
+using borrow::BorrowResult;
+#endif
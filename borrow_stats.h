@@ -0,0 +1,147 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace borrow {
+
+// Optional instrumentation for the borrow checkers. Build with
+// -DBORROW_CHECKER_STATS to enable it; otherwise every hook is an empty inline
+// function on an empty member and compiles away.
+//
+// Counters are sharded: each thread bumps its own cache-line-sized shard with
+// relaxed atomics, and stats() sums the shards into a BorrowStats snapshot.
+
+constexpr std::size_t kProbeBuckets = 16;
+
+// Point-in-time view of one checker's counters.
+struct BorrowStats {
+  bool enabled = false;
+  std::uint64_t adds = 0;
+  std::uint64_t removes = 0;
+  std::uint64_t checks = 0;
+  // Rejected borrows, indexed by the BorrowState that was already held.
+  std::array<std::uint64_t, 4> conflicts{};
+  // Most addresses tracked at once.
+  std::uint64_t peak_live = 0;
+  // Addresses that overflowed a fixed-capacity checker.
+  std::uint64_t spills = 0;
+  // Slots examined per lookup, bucketed by powers of two: bucket 0 holds
+  // lengths 0 and 1, bucket b holds [2^b, 2^(b+1)), the last bucket the rest.
+  std::array<std::uint64_t, kProbeBuckets> probe_lengths{};
+};
+
+inline std::size_t probe_bucket(std::size_t length) {
+  std::size_t bucket = length == 0 ? 0 : std::bit_width(length) - 1;
+  return bucket < kProbeBuckets ? bucket : kProbeBuckets - 1;
+}
+
+class ShardedBorrowStats {
+private:
+  static constexpr std::size_t kShards = 16;
+
+  struct alignas(64) Shard {
+    std::atomic<std::uint64_t> adds{0};
+    std::atomic<std::uint64_t> removes{0};
+    std::atomic<std::uint64_t> checks{0};
+    std::atomic<std::uint64_t> spills{0};
+    std::array<std::atomic<std::uint64_t>, 4> conflicts{};
+    std::array<std::atomic<std::uint64_t>, kProbeBuckets> probe_lengths{};
+  };
+
+  std::array<Shard, kShards> shards_{};
+  std::atomic<std::uint64_t> peak_live_{0};
+
+  // Threads are spread over the shards in the order they first record.
+  static Shard &local(std::array<Shard, kShards> &shards) {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t index =
+        next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shards[index];
+  }
+
+  static void bump(std::atomic<std::uint64_t> &counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+public:
+  static constexpr bool enabled = true;
+
+  void on_add() { bump(local(shards_).adds); }
+
+  void on_remove() { bump(local(shards_).removes); }
+
+  void on_check() { bump(local(shards_).checks); }
+
+  void on_spill() { bump(local(shards_).spills); }
+
+  void on_conflict(std::size_t held_state) {
+    bump(local(shards_).conflicts[held_state]);
+  }
+
+  void on_probe(std::size_t length) {
+    bump(local(shards_).probe_lengths[probe_bucket(length)]);
+  }
+
+  void on_live(std::size_t live) {
+    std::uint64_t peak = peak_live_.load(std::memory_order_relaxed);
+    while (live > peak && !peak_live_.compare_exchange_weak(
+                              peak, live, std::memory_order_relaxed)) {
+    }
+  }
+
+  BorrowStats snapshot() const {
+    BorrowStats stats;
+    stats.enabled = true;
+    for (const Shard &shard : shards_) {
+      stats.adds += shard.adds.load(std::memory_order_relaxed);
+      stats.removes += shard.removes.load(std::memory_order_relaxed);
+      stats.checks += shard.checks.load(std::memory_order_relaxed);
+      stats.spills += shard.spills.load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < stats.conflicts.size(); ++i) {
+        stats.conflicts[i] += shard.conflicts[i].load(std::memory_order_relaxed);
+      }
+      for (std::size_t i = 0; i < kProbeBuckets; ++i) {
+        stats.probe_lengths[i] +=
+            shard.probe_lengths[i].load(std::memory_order_relaxed);
+      }
+    }
+    stats.peak_live = peak_live_.load(std::memory_order_relaxed);
+    return stats;
+  }
+};
+
+class NullBorrowStats {
+public:
+  static constexpr bool enabled = false;
+
+  constexpr void on_add() {}
+  constexpr void on_remove() {}
+  constexpr void on_check() {}
+  constexpr void on_spill() {}
+  constexpr void on_conflict(std::size_t) {}
+  constexpr void on_probe(std::size_t) {}
+  constexpr void on_live(std::size_t) {}
+
+  BorrowStats snapshot() const { return {}; }
+};
+
+#ifdef BORROW_CHECKER_STATS
+using BorrowStatsCounters = ShardedBorrowStats;
+#else
+using BorrowStatsCounters = NullBorrowStats;
+#endif
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::kProbeBuckets;
+using borrow::BorrowStats;
+using borrow::probe_bucket;
+using borrow::ShardedBorrowStats;
+using borrow::NullBorrowStats;
+using borrow::BorrowStatsCounters;
+#endif
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "borrow_error.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace borrow {
+
+// Optional event trace for the borrow checkers. Build with
+// -DBORROW_CHECKER_TRACE to enable it; otherwise every hook is an empty
+// inline function and compiles away.
+//
+// Each thread appends fixed-size records to a ring buffer of its own, so
+// recording is a handful of plain stores and one release store of the ring's
+// head, with no lock or shared cache line. When a ring is full the oldest
+// records are overwritten. BorrowTraceRecorder::dump() writes every ring to a
+// file through a shared mapping; tools/trace_analyze reads it back.
+//
+// A dump taken while other threads are still borrowing can contain a few
+// torn records where a ring was being written; dump from a quiet point for
+// an exact trace.
+
+enum class BorrowTraceEvent : std::uint8_t { Add, Remove, RemoveAll, Conflict };
+
+// One event, 32 bytes on disk and in memory.
+struct BorrowTraceRecord {
+  std::uint64_t timestamp; // ticks, see BorrowTraceHeader::ticks_per_ns
+  std::uint64_t address;
+  std::uint64_t caller; // return address in the code that took the borrow
+  std::uint32_t thread; // small per-process thread number, from 1
+  BorrowTraceEvent event;
+  std::uint8_t state; // BorrowState asked for or released
+  std::uint8_t held;  // for a Conflict, the BorrowState that was held
+  std::uint8_t reserved;
+};
+
+static_assert(sizeof(BorrowTraceRecord) == 32,
+              "trace records have a fixed on-disk size");
+
+// Start of a dump file, followed by record_count records in per-thread runs,
+// each run oldest first.
+struct BorrowTraceHeader {
+  static constexpr char kMagic[8] = {'B', 'R', 'W', 'T', 'R', 'A', 'C', 'E'};
+  static constexpr std::uint32_t kVersion = 1;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t record_size;
+  std::uint64_t record_count;
+  double ticks_per_ns;
+};
+
+#ifndef BORROW_TRACE_RING_RECORDS
+#define BORROW_TRACE_RING_RECORDS (1u << 14)
+#endif
+
+class BorrowTraceRecorder {
+private:
+  static constexpr std::size_t kRingRecords = BORROW_TRACE_RING_RECORDS;
+  static_assert((kRingRecords & (kRingRecords - 1)) == 0,
+                "BORROW_TRACE_RING_RECORDS must be a power of two");
+
+  struct Ring {
+    std::uint32_t thread;
+    std::atomic<std::uint64_t> head{0};
+    BorrowTraceRecord records[kRingRecords];
+  };
+
+  // Rings outlive their threads so that a dump still sees the events of
+  // threads that have exited.
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Ring>> rings_; // guarded by mutex_
+  std::uint64_t start_ticks_;
+  std::chrono::steady_clock::time_point start_time_;
+
+  BorrowTraceRecorder()
+      : start_ticks_(ticks()), start_time_(std::chrono::steady_clock::now()) {}
+
+  Ring &local() {
+    thread_local Ring *ring = attach();
+    return *ring;
+  }
+
+  Ring *attach() {
+    auto ring = std::make_unique<Ring>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    ring->thread = static_cast<std::uint32_t>(rings_.size() + 1);
+    rings_.push_back(std::move(ring));
+    return rings_.back().get();
+  }
+
+  double ticks_per_ns() const {
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start_time_)
+                    .count();
+    double elapsed = static_cast<double>(ticks() - start_ticks_);
+    return ns > 0 && elapsed > 0 ? elapsed / ns : 1.0;
+  }
+
+public:
+  static BorrowTraceRecorder &instance() {
+    static BorrowTraceRecorder recorder;
+    return recorder;
+  }
+
+  // The time stamp counter where there is one, steady_clock nanoseconds
+  // elsewhere.
+  static std::uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+  }
+
+  void record(BorrowTraceEvent event, const void *ptr, std::uint8_t state,
+              std::uint8_t held, const void *caller) {
+    Ring &ring = local();
+    std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+    ring.records[head & (kRingRecords - 1)] = {
+        ticks(),
+        reinterpret_cast<std::uintptr_t>(ptr),
+        reinterpret_cast<std::uintptr_t>(caller),
+        ring.thread,
+        event,
+        state,
+        held,
+        0};
+    ring.head.store(head + 1, std::memory_order_release);
+  }
+
+  // Writes the records currently held by every ring to path, replacing the
+  // file. Throws std::runtime_error if the file can't be written.
+  void dump(const char *path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::uint64_t> heads;
+    std::uint64_t total = 0;
+    for (const auto &ring : rings_) {
+      heads.push_back(ring->head.load(std::memory_order_acquire));
+      total += std::min<std::uint64_t>(heads.back(), kRingRecords);
+    }
+    std::size_t size = sizeof(BorrowTraceHeader) +
+                       static_cast<std::size_t>(total) *
+                           sizeof(BorrowTraceRecord);
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      borrow_error("cannot open borrow trace file");
+    }
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      ::close(fd);
+      borrow_error("cannot size borrow trace file");
+    }
+    void *mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      borrow_error("cannot map borrow trace file");
+    }
+
+    auto *out = static_cast<unsigned char *>(mapping);
+    BorrowTraceHeader header{};
+    std::memcpy(header.magic, BorrowTraceHeader::kMagic, sizeof(header.magic));
+    header.version = BorrowTraceHeader::kVersion;
+    header.record_size = sizeof(BorrowTraceRecord);
+    header.record_count = total;
+    header.ticks_per_ns = ticks_per_ns();
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    for (std::size_t i = 0; i < rings_.size(); ++i) {
+      std::uint64_t head = heads[i];
+      std::uint64_t first = head > kRingRecords ? head - kRingRecords : 0;
+      for (std::uint64_t n = first; n < head; ++n) {
+        std::memcpy(out, &rings_[i]->records[n & (kRingRecords - 1)],
+                    sizeof(BorrowTraceRecord));
+        out += sizeof(BorrowTraceRecord);
+      }
+    }
+    ::munmap(mapping, size);
+  }
+
+  // Drops every recorded event.
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &ring : rings_) {
+      ring->head.store(0, std::memory_order_release);
+    }
+  }
+};
+
+class RecordingBorrowTrace {
+public:
+  static constexpr bool enabled = true;
+
+  static void on_add(const void *ptr, std::uint8_t state, const void *caller) {
+    BorrowTraceRecorder::instance().record(BorrowTraceEvent::Add, ptr, state,
+                                           0, caller);
+  }
+
+  static void on_remove(const void *ptr, std::uint8_t state,
+                        const void *caller) {
+    BorrowTraceRecorder::instance().record(BorrowTraceEvent::Remove, ptr,
+                                           state, 0, caller);
+  }
+
+  static void on_remove_all(const void *ptr, const void *caller) {
+    BorrowTraceRecorder::instance().record(BorrowTraceEvent::RemoveAll, ptr, 0,
+                                           0, caller);
+  }
+
+  static void on_conflict(const void *ptr, std::uint8_t state,
+                          std::uint8_t held, const void *caller) {
+    BorrowTraceRecorder::instance().record(BorrowTraceEvent::Conflict, ptr,
+                                           state, held, caller);
+  }
+};
+
+class NullBorrowTrace {
+public:
+  static constexpr bool enabled = false;
+
+  static constexpr void on_add(const void *, std::uint8_t, const void *) {}
+  static constexpr void on_remove(const void *, std::uint8_t, const void *) {}
+  static constexpr void on_remove_all(const void *, const void *) {}
+  static constexpr void on_conflict(const void *, std::uint8_t, std::uint8_t,
+                                    const void *) {}
+};
+
+#ifdef BORROW_CHECKER_TRACE
+using BorrowTrace = RecordingBorrowTrace;
+#define BORROW_TRACE_CALLER() __builtin_return_address(0)
+#else
+using BorrowTrace = NullBorrowTrace;
+#define BORROW_TRACE_CALLER() nullptr
+#endif
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::BorrowTraceEvent;
+using borrow::BorrowTraceRecord;
+using borrow::BorrowTraceHeader;
+using borrow::BorrowTraceRecorder;
+using borrow::RecordingBorrowTrace;
+using borrow::NullBorrowTrace;
+using borrow::BorrowTrace;
+#endif
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "borrow_error.h"
+#include "concurrent_checker.h"
+
+namespace borrow {
+
+// Containers that keep the borrow state of each element in the container
+// itself instead of in a BorrowChecker. Every element has an AtomicBorrowWord
+// of its own, so borrowing an element is one atomic operation on that word:
+// no lookup, no lock, and threads borrowing different elements never touch
+// the same record.
+//
+// Borrows only synchronise with each other. Changing the shape of a container
+// (inserting, erasing) needs the same exclusion as any standard container and
+// must not race with borrows.
+
+// Takes a borrow of the given kind on every word in [words, words + count),
+// or on none of them if one conflicts.
+inline bool try_acquire_words(AtomicBorrowWord *words, std::size_t count,
+                              BorrowState state) {
+  for (std::size_t i = 0; i < count; ++i) {
+    if (!words[i].try_acquire(state)) {
+      while (i-- > 0) {
+        words[i].release(state);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+inline void release_words(AtomicBorrowWord *words, std::size_t count,
+                          BorrowState state) {
+  for (std::size_t i = 0; i < count; ++i) {
+    words[i].release(state);
+  }
+}
+
+// Shared borrow of one element of a BorrowVec or BorrowMap.
+template <typename T> class ElementRef {
+private:
+  const T *data_;
+  AtomicBorrowWord *word_;
+
+public:
+  ElementRef(const T *data, AtomicBorrowWord *word)
+      : data_(data), word_(word) {
+    assert(word_ != nullptr); // make sure word is not nullptr
+    if (!word_->try_acquire(BorrowState::Valid)) {
+      fail_borrow(
+          {BorrowErrc::SharedWhileMutable, BorrowState::MutableBorrowed});
+    }
+  }
+
+  ElementRef(const ElementRef &) = delete;
+  ElementRef &operator=(const ElementRef &) = delete;
+
+  ElementRef(ElementRef &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)), word_(other.word_) {}
+
+  ElementRef &operator=(ElementRef &&other) noexcept {
+    if (this != &other) {
+      if (data_ != nullptr) {
+        word_->release(BorrowState::Valid);
+      }
+      data_ = std::exchange(other.data_, nullptr);
+      word_ = other.word_;
+    }
+    return *this;
+  }
+
+  ~ElementRef() {
+    if (data_ != nullptr) {
+      word_->release(BorrowState::Valid);
+    }
+  }
+
+  const T *operator->() const { return data_; }
+
+  const T &operator*() const { return *data_; }
+};
+
+// Exclusive borrow of one element of a BorrowVec or BorrowMap.
+template <typename T> class ElementMutRef {
+private:
+  T *data_;
+  AtomicBorrowWord *word_;
+
+public:
+  ElementMutRef(T *data, AtomicBorrowWord *word) : data_(data), word_(word) {
+    assert(word_ != nullptr); // make sure word is not nullptr
+    if (!word_->try_acquire(BorrowState::MutableBorrowed)) {
+      fail_borrow({BorrowErrc::MutableWhileBorrowed, word_->load().state()});
+    }
+  }
+
+  ElementMutRef(const ElementMutRef &) = delete;
+  ElementMutRef &operator=(const ElementMutRef &) = delete;
+
+  ElementMutRef(ElementMutRef &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)), word_(other.word_) {}
+
+  ElementMutRef &operator=(ElementMutRef &&other) noexcept {
+    if (this != &other) {
+      if (data_ != nullptr) {
+        word_->release(BorrowState::MutableBorrowed);
+      }
+      data_ = std::exchange(other.data_, nullptr);
+      word_ = other.word_;
+    }
+    return *this;
+  }
+
+  ~ElementMutRef() {
+    if (data_ != nullptr) {
+      word_->release(BorrowState::MutableBorrowed);
+    }
+  }
+
+  T *operator->() const { return data_; }
+
+  T &operator*() const { return *data_; }
+};
+
+// Shared borrow of a contiguous range of BorrowVec elements. Taking it costs
+// one atomic per element, and it conflicts with a mutable borrow of any
+// element in the range.
+template <typename T> class RangeRef {
+private:
+  std::span<const T> data_;
+  AtomicBorrowWord *words_;
+
+public:
+  RangeRef(std::span<const T> data, AtomicBorrowWord *words)
+      : data_(data), words_(words) {
+    if (!try_acquire_words(words_, data_.size(), BorrowState::Valid)) {
+      fail_borrow(
+          {BorrowErrc::SharedWhileMutable, BorrowState::MutableBorrowed});
+    }
+  }
+
+  RangeRef(const RangeRef &) = delete;
+  RangeRef &operator=(const RangeRef &) = delete;
+
+  RangeRef(RangeRef &&other) noexcept
+      : data_(std::exchange(other.data_, {})), words_(other.words_) {}
+
+  RangeRef &operator=(RangeRef &&other) noexcept {
+    if (this != &other) {
+      release_words(words_, data_.size(), BorrowState::Valid);
+      data_ = std::exchange(other.data_, {});
+      words_ = other.words_;
+    }
+    return *this;
+  }
+
+  ~RangeRef() { release_words(words_, data_.size(), BorrowState::Valid); }
+
+  std::span<const T> operator*() const { return data_; }
+
+  const T &operator[](std::size_t i) const { return data_[i]; }
+
+  std::size_t size() const { return data_.size(); }
+
+  auto begin() const { return data_.begin(); }
+
+  auto end() const { return data_.end(); }
+};
+
+// Exclusive borrow of a contiguous range of BorrowVec elements.
+template <typename T> class RangeMutRef {
+private:
+  struct Adopt {};
+
+  std::span<T> data_;
+  AtomicBorrowWord *words_;
+
+  // Takes over words the caller already holds mutably.
+  RangeMutRef(std::span<T> data, AtomicBorrowWord *words, Adopt)
+      : data_(data), words_(words) {}
+
+public:
+  RangeMutRef(std::span<T> data, AtomicBorrowWord *words)
+      : data_(data), words_(words) {
+    if (!try_acquire_words(words_, data_.size(),
+                           BorrowState::MutableBorrowed)) {
+      fail_borrow({BorrowErrc::MutableWhileBorrowed, BorrowState::Invalid});
+    }
+  }
+
+  RangeMutRef(const RangeMutRef &) = delete;
+  RangeMutRef &operator=(const RangeMutRef &) = delete;
+
+  RangeMutRef(RangeMutRef &&other) noexcept
+      : data_(std::exchange(other.data_, {})), words_(other.words_) {}
+
+  RangeMutRef &operator=(RangeMutRef &&other) noexcept {
+    if (this != &other) {
+      release_words(words_, data_.size(), BorrowState::MutableBorrowed);
+      data_ = std::exchange(other.data_, {});
+      words_ = other.words_;
+    }
+    return *this;
+  }
+
+  ~RangeMutRef() {
+    release_words(words_, data_.size(), BorrowState::MutableBorrowed);
+  }
+
+  std::span<T> operator*() const { return data_; }
+
+  T &operator[](std::size_t i) const { return data_[i]; }
+
+  std::size_t size() const { return data_.size(); }
+
+  auto begin() const { return data_.begin(); }
+
+  auto end() const { return data_.end(); }
+
+  // Splits the borrow into [0, n) and [n, size()), like Rust's
+  // split_at_mut. Every word is already held, so this costs no atomics.
+  std::pair<RangeMutRef, RangeMutRef> split_at(std::size_t n) && {
+    assert(n <= data_.size()); // make sure the split point is in range
+    std::span<T> data = std::exchange(data_, {});
+    return {RangeMutRef(data.first(n), words_, Adopt{}),
+            RangeMutRef(data.subspan(n), words_ + n, Adopt{})};
+  }
+
+  // Splits the borrow into consecutive pieces of chunk_size elements, the
+  // last one possibly shorter.
+  std::vector<RangeMutRef> chunks(std::size_t chunk_size) && {
+    assert(chunk_size != 0); // make sure chunks are not empty
+    std::span<T> data = std::exchange(data_, {});
+    std::vector<RangeMutRef> pieces;
+    pieces.reserve((data.size() + chunk_size - 1) / chunk_size);
+    for (std::size_t i = 0; i < data.size(); i += chunk_size) {
+      pieces.push_back(RangeMutRef(
+          data.subspan(i, std::min(chunk_size, data.size() - i)), words_ + i,
+          Adopt{}));
+    }
+    return pieces;
+  }
+};
+
+// Fixed-size array of elements with one borrow word each. The words sit in a
+// separate array that starts on a cache line, so scanning the elements is not
+// slowed down by the state and a range borrow walks consecutive words.
+//
+// Neighbouring words share a cache line; threads that each work on their own
+// block of elements (see borrow_range_mut) keep to their own lines.
+template <typename T> class BorrowVec {
+private:
+  static constexpr std::size_t kCacheLine = 64;
+
+  struct WordsDeleter {
+    std::size_t size;
+
+    void operator()(AtomicBorrowWord *words) const {
+      std::destroy_n(words, size);
+      ::operator delete(words, std::align_val_t{kCacheLine});
+    }
+  };
+
+  std::vector<T> elements_;
+  std::unique_ptr<AtomicBorrowWord[], WordsDeleter> words_;
+
+  static std::unique_ptr<AtomicBorrowWord[], WordsDeleter>
+  make_words(std::size_t size) {
+    void *storage = ::operator new(
+        std::max<std::size_t>(size, 1) * sizeof(AtomicBorrowWord),
+        std::align_val_t{kCacheLine});
+    auto *words = static_cast<AtomicBorrowWord *>(storage);
+    std::uninitialized_default_construct_n(words, size);
+    return {words, WordsDeleter{size}};
+  }
+
+  void check_index(std::size_t i) const {
+    if (i >= elements_.size()) {
+      borrow_error<std::out_of_range>("borrow index out of range");
+    }
+  }
+
+  void check_range(std::size_t begin, std::size_t end) const {
+    if (begin > end || end > elements_.size()) {
+      borrow_error<std::out_of_range>("borrow range out of range");
+    }
+  }
+
+public:
+  explicit BorrowVec(std::size_t size, const T &value = T())
+      : elements_(size, value), words_(make_words(size)) {}
+
+  explicit BorrowVec(std::vector<T> elements)
+      : elements_(std::move(elements)), words_(make_words(elements_.size())) {}
+
+  BorrowVec(const BorrowVec &) = delete;
+  BorrowVec &operator=(const BorrowVec &) = delete;
+
+  // Moving keeps the elements and words where they are, so outstanding
+  // borrows stay valid and follow the new BorrowVec.
+  BorrowVec(BorrowVec &&) noexcept = default;
+
+  // Frees this vector's own elements first, which must not be borrowed;
+  // checked unless NDEBUG is defined, like the destructor.
+  BorrowVec &operator=(BorrowVec &&other) {
+    if (this != &other) {
+#ifndef NDEBUG
+      if (borrowed()) {
+        fail_borrow({BorrowErrc::MutableWhileBorrowed, BorrowState::Invalid});
+      }
+#endif
+      elements_ = std::move(other.elements_);
+      words_ = std::move(other.words_);
+      other.elements_.clear();
+    }
+    return *this;
+  }
+
+  ~BorrowVec() {
+    assert(!borrowed()); // make sure no element outlives the vector borrowed
+  }
+
+  std::size_t size() const { return elements_.size(); }
+
+  bool empty() const { return elements_.empty(); }
+
+  ElementRef<T> borrow(std::size_t i) const {
+    check_index(i);
+    return ElementRef<T>(&elements_[i], &words_[i]);
+  }
+
+  ElementMutRef<T> borrow_mut(std::size_t i) {
+    check_index(i);
+    return ElementMutRef<T>(&elements_[i], &words_[i]);
+  }
+
+  // Shared borrow of the elements [begin, end).
+  RangeRef<T> borrow_range(std::size_t begin, std::size_t end) const {
+    check_range(begin, end);
+    return RangeRef<T>(
+        std::span<const T>(elements_.data() + begin, end - begin),
+        &words_[begin]);
+  }
+
+  // Exclusive borrow of the elements [begin, end).
+  RangeMutRef<T> borrow_range_mut(std::size_t begin, std::size_t end) {
+    check_range(begin, end);
+    return RangeMutRef<T>(std::span<T>(elements_.data() + begin, end - begin),
+                          &words_[begin]);
+  }
+
+  BorrowState check_borrow(std::size_t i) const {
+    check_index(i);
+    return words_[i].load().state();
+  }
+
+  std::uint32_t shared_count(std::size_t i) const {
+    check_index(i);
+    return words_[i].load().shared_count();
+  }
+
+  // Whether any element is borrowed. Reads every word.
+  bool borrowed() const {
+    for (std::size_t i = 0; i < elements_.size(); ++i) {
+      if (words_[i].load().word != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Gives the elements back as a plain vector; throws if any is borrowed.
+  std::vector<T> into_vector() && {
+    if (borrowed()) {
+      borrow_error("cannot drop a value while it is borrowed");
+    }
+    words_ = make_words(0);
+    return std::move(elements_);
+  }
+};
+
+// Hash map whose values each carry their own borrow word, stored in the same
+// node as the value. Nodes don't move on rehash, so a borrow stays valid
+// while other keys are inserted, as long as the insertion is not concurrent
+// with borrowing.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class BorrowMap {
+private:
+  struct Entry {
+    V value;
+    mutable AtomicBorrowWord word;
+
+    template <typename... Args>
+    explicit Entry(Args &&...args) : value(std::forward<Args>(args)...) {}
+  };
+
+  std::unordered_map<K, Entry, Hash, KeyEqual> entries_;
+
+  const Entry &entry(const K &key) const {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      borrow_error<std::out_of_range>("borrowed key is not in the map");
+    }
+    return it->second;
+  }
+
+  Entry &entry(const K &key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      borrow_error<std::out_of_range>("borrowed key is not in the map");
+    }
+    return it->second;
+  }
+
+public:
+  BorrowMap() = default;
+
+  BorrowMap(const BorrowMap &) = delete;
+  BorrowMap &operator=(const BorrowMap &) = delete;
+
+  ~BorrowMap() {
+    for (auto &[key, entry] : entries_) {
+      assert(entry.word.load().word == 0); // make sure no value is borrowed
+    }
+  }
+
+  std::size_t size() const { return entries_.size(); }
+
+  bool contains(const K &key) const { return entries_.contains(key); }
+
+  // Constructs a value for key from args unless key is already present;
+  // returns whether it was inserted.
+  template <typename... Args> bool try_emplace(const K &key, Args &&...args) {
+    return entries_.try_emplace(key, std::forward<Args>(args)...).second;
+  }
+
+  // Removes key; returns false if it wasn't present and throws if its value
+  // is borrowed.
+  bool erase(const K &key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return false;
+    }
+    if (it->second.word.load().word != 0) {
+      borrow_error("cannot drop a value while it is borrowed");
+    }
+    entries_.erase(it);
+    return true;
+  }
+
+  ElementRef<V> borrow(const K &key) const {
+    const Entry &found = entry(key);
+    return ElementRef<V>(&found.value, &found.word);
+  }
+
+  ElementMutRef<V> borrow_mut(const K &key) {
+    Entry &found = entry(key);
+    return ElementMutRef<V>(&found.value, &found.word);
+  }
+
+  BorrowState check_borrow(const K &key) const {
+    return entry(key).word.load().state();
+  }
+
+  std::uint32_t shared_count(const K &key) const {
+    return entry(key).word.load().shared_count();
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::try_acquire_words;
+using borrow::release_words;
+using borrow::ElementRef;
+using borrow::ElementMutRef;
+using borrow::RangeRef;
+using borrow::RangeMutRef;
+using borrow::BorrowVec;
+using borrow::BorrowMap;
+#endif
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+#include "v2.h"
+
+namespace borrow {
+
+// A value that carries its own borrow state. Borrowable<T> implements the
+// checker interface for the one address it holds, so the v2 wrappers work on
+// it directly, e.g. Ref<T, Borrowable<T>>, and every check reads the record
+// stored right next to the value instead of looking the address up in a
+// shared table.
+template <typename T> class Borrowable {
+private:
+  T value_;
+  BorrowRecord record_;
+
+public:
+  template <typename... Args>
+  explicit Borrowable(Args &&...args) : value_(std::forward<Args>(args)...) {}
+
+  // The borrow state belongs to this address, so the value never moves.
+  Borrowable(const Borrowable &) = delete;
+  Borrowable &operator=(const Borrowable &) = delete;
+
+  ~Borrowable() {
+    assert((record_.word & ~BorrowRecord::kOwned) ==
+           0); // make sure no borrow outlives the value
+  }
+
+  T *get() { return &value_; }
+
+  Ref<T, Borrowable> borrow() { return Ref<T, Borrowable>(&value_, this); }
+
+  MutableRef<T, Borrowable> borrow_mut() {
+    return MutableRef<T, Borrowable>(&value_, this);
+  }
+
+  void add_borrow(void *ptr, BorrowState state) {
+    assert(ptr == &value_); // make sure the borrow is of this value
+    record_.acquire(state);
+  }
+
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    assert(ptr == &value_); // make sure the borrow is of this value
+    if (!record_.allows(state)) {
+      return false;
+    }
+    record_.acquire(state);
+    return true;
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    assert(ptr == &value_); // make sure the borrow is of this value
+    record_.release(state);
+  }
+
+  void remove_borrow(void *ptr) {
+    assert(ptr == &value_); // make sure the borrow is of this value
+    record_ = BorrowRecord{};
+  }
+
+  BorrowState check_borrow(void *) const { return record_.state(); }
+
+  std::uint32_t shared_count(void *) const { return record_.shared_count(); }
+
+  void set_owned(void *) { record_.acquire(BorrowState::Owned); }
+
+  bool check_owned(void *) const {
+    return (record_.word & BorrowRecord::kOwned) != 0;
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::Borrowable;
+#endif
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "borrow_error.h"
+#include "ptr_map.h"
+#include "v2.h"
+
+namespace borrow {
+
+// One address's borrow state as an atomic word laid out like BorrowRecord. A
+// shared borrow optimistically bumps the count and backs out if a mutable
+// borrow was already present; an exclusive borrow only succeeds on an
+// untouched word.
+class AtomicBorrowWord {
+private:
+  std::atomic<std::uint32_t> word_{0};
+
+public:
+  bool try_acquire(BorrowState state) {
+    if (state == BorrowState::MutableBorrowed) {
+      std::uint32_t expected = 0;
+      return word_.compare_exchange_strong(expected, BorrowRecord::kMutable,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed);
+    }
+    if (state == BorrowState::Valid) {
+      std::uint32_t prev = word_.fetch_add(1, std::memory_order_acquire);
+      if (prev & BorrowRecord::kMutable) {
+        word_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+      }
+      return true;
+    }
+    if (state == BorrowState::Owned) {
+      std::uint32_t word = word_.load(std::memory_order_relaxed);
+      do {
+        if (word & BorrowRecord::kMutable) {
+          return false;
+        }
+      } while (!word_.compare_exchange_weak(word, word | BorrowRecord::kOwned,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed));
+      return true;
+    }
+    return true;
+  }
+
+  void acquire(BorrowState state) {
+    switch (state) {
+    case BorrowState::Valid:
+      word_.fetch_add(1, std::memory_order_acquire);
+      break;
+    case BorrowState::MutableBorrowed:
+      word_.fetch_or(BorrowRecord::kMutable, std::memory_order_acquire);
+      break;
+    case BorrowState::Owned:
+      word_.fetch_or(BorrowRecord::kOwned, std::memory_order_acquire);
+      break;
+    case BorrowState::Invalid:
+      break;
+    }
+  }
+
+  void release(BorrowState state) {
+    switch (state) {
+    case BorrowState::Valid:
+      word_.fetch_sub(1, std::memory_order_release);
+      break;
+    case BorrowState::MutableBorrowed:
+      word_.fetch_and(~BorrowRecord::kMutable, std::memory_order_release);
+      break;
+    case BorrowState::Owned:
+      word_.fetch_and(~BorrowRecord::kOwned, std::memory_order_release);
+      break;
+    case BorrowState::Invalid:
+      break;
+    }
+  }
+
+  void clear() { word_.store(0, std::memory_order_release); }
+
+  BorrowRecord load() const {
+    return BorrowRecord{word_.load(std::memory_order_acquire)};
+  }
+};
+
+// Borrow checker that can be shared between threads without a lock. Every
+// tracked address owns one atomic word laid out like BorrowRecord (shared
+// count, mutable bit, owned bit), so a shared borrow is a fetch_add and an
+// exclusive borrow a compare-and-swap from zero. Words are found through a
+// fixed-capacity open-addressing index whose keys are claimed with a CAS.
+//
+// Index slots are never given back: once an address has been seen its slot
+// stays keyed to it and its word simply returns to zero. Size the checker for
+// the number of distinct addresses it will track over its lifetime; running
+// out of slots throws std::runtime_error, or aborts without exceptions.
+//
+// Usable with the v2 wrappers, e.g. Ref<T, ConcurrentBorrowChecker>.
+class ConcurrentBorrowChecker {
+private:
+  struct Slot {
+    std::atomic<void *> ptr{nullptr};
+    AtomicBorrowWord word;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  std::size_t mask_;
+
+  AtomicBorrowWord *find(void *ptr) const {
+    std::size_t i = ptr_hash(ptr) & mask_;
+    for (std::size_t probes = 0; probes <= mask_; ++probes) {
+      void *key = slots_[i].ptr.load(std::memory_order_acquire);
+      if (key == ptr) {
+        return &slots_[i].word;
+      }
+      if (key == nullptr) {
+        return nullptr;
+      }
+      i = (i + 1) & mask_;
+    }
+    return nullptr;
+  }
+
+  AtomicBorrowWord &find_or_insert(void *ptr) {
+    std::size_t i = ptr_hash(ptr) & mask_;
+    for (std::size_t probes = 0; probes <= mask_; ++probes) {
+      void *key = slots_[i].ptr.load(std::memory_order_acquire);
+      if (key == nullptr &&
+          slots_[i].ptr.compare_exchange_strong(key, ptr,
+                                                std::memory_order_acq_rel)) {
+        return slots_[i].word;
+      }
+      // Either the slot already held a key or another thread just claimed
+      // it; in both cases key now names the occupant.
+      if (key == ptr) {
+        return slots_[i].word;
+      }
+      i = (i + 1) & mask_;
+    }
+    borrow_error("borrow checker index is full");
+  }
+
+public:
+  // capacity is rounded up to a power of two.
+  explicit ConcurrentBorrowChecker(std::size_t capacity = 1 << 16) {
+    std::size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    }
+    slots_.reset(new Slot[size]);
+    mask_ = size - 1;
+  }
+
+  ConcurrentBorrowChecker(const ConcurrentBorrowChecker &) = delete;
+  ConcurrentBorrowChecker &operator=(const ConcurrentBorrowChecker &) = delete;
+
+  void add_borrow(void *ptr, BorrowState state) {
+    find_or_insert(ptr).acquire(state);
+  }
+
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    return find_or_insert(ptr).try_acquire(state);
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    if (AtomicBorrowWord *word = find(ptr)) {
+      word->release(state);
+    }
+  }
+
+  // Drops every borrow recorded for ptr.
+  void remove_borrow(void *ptr) {
+    if (AtomicBorrowWord *word = find(ptr)) {
+      word->clear();
+    }
+  }
+
+  BorrowState check_borrow(void *ptr) const {
+    AtomicBorrowWord *word = find(ptr);
+    return word == nullptr ? BorrowState::Valid : word->load().state();
+  }
+
+  std::uint32_t shared_count(void *ptr) const {
+    AtomicBorrowWord *word = find(ptr);
+    return word == nullptr ? 0 : word->load().shared_count();
+  }
+
+  void set_owned(void *ptr) {
+    if (AtomicBorrowWord *word = find(ptr)) {
+      word->acquire(BorrowState::Owned);
+    }
+  }
+
+  bool check_owned(void *ptr) const {
+    AtomicBorrowWord *word = find(ptr);
+    return word != nullptr && (word->load().word & BorrowRecord::kOwned);
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::AtomicBorrowWord;
+using borrow::ConcurrentBorrowChecker;
+#endif
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "v2.h"
+
+namespace borrow {
+
+// Borrow checker that defers the release of shared borrows. Dropping a Ref
+// only appends its address to a log; the log is applied to the table at the
+// end of each epoch, when it fills up or when advance_epoch() is called.
+// A Ref taken again on the same address before then finds its record still
+// in place, so tight loops over a few objects stop inserting and erasing the
+// same records.
+//
+// Deferral never changes an answer. A pending release only leaves the shared
+// count too high, so a borrow that conflicts applies the log and tries again,
+// shared_count() discounts pending releases, and dropping a record discards
+// its pending releases. Mutable and owned releases are applied at once.
+//
+// Like the checker it wraps, the log belongs to one thread.
+//
+// Usable with the v2 wrappers, e.g. Ref<T, EpochBorrowChecker<>>.
+template <typename Storage = FlatStorage> class EpochBorrowChecker {
+private:
+  BasicBorrowChecker<Storage> checker_;
+  std::vector<void *> released_;
+  std::size_t epoch_length_;
+  std::uint64_t epoch_ = 0;
+
+public:
+  // epoch_length is the number of shared releases logged before the log is
+  // applied on its own.
+  explicit EpochBorrowChecker(std::size_t epoch_length = 256)
+      : epoch_length_(epoch_length) {
+    released_.reserve(epoch_length_);
+  }
+
+  EpochBorrowChecker(const EpochBorrowChecker &) = delete;
+  EpochBorrowChecker &operator=(const EpochBorrowChecker &) = delete;
+
+  // Applies every logged release and starts a new epoch.
+  void advance_epoch() {
+    for (void *ptr : released_) {
+      checker_.remove_borrow(ptr, BorrowState::Valid);
+    }
+    released_.clear();
+    ++epoch_;
+  }
+
+  std::uint64_t epoch() const { return epoch_; }
+
+  std::size_t pending_releases() const { return released_.size(); }
+
+  void add_borrow(void *ptr, BorrowState state) {
+    checker_.add_borrow(ptr, state);
+  }
+
+  // Takes a borrow of the given kind unless it conflicts with the borrows
+  // still held on ptr; returns false on conflict.
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    if (checker_.try_add_borrow(ptr, state)) {
+      return true;
+    }
+    if (released_.empty()) {
+      return false;
+    }
+    // The conflict may be with borrows that were already released.
+    advance_epoch();
+    return checker_.try_add_borrow(ptr, state);
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    if (state != BorrowState::Valid) {
+      checker_.remove_borrow(ptr, state);
+      return;
+    }
+    released_.push_back(ptr);
+    if (released_.size() >= epoch_length_) {
+      advance_epoch();
+    }
+  }
+
+  // Drops every borrow recorded for ptr, pending releases included.
+  void remove_borrow(void *ptr) {
+    std::erase(released_, ptr);
+    checker_.remove_borrow(ptr);
+  }
+
+  BorrowState check_borrow(void *ptr) { return checker_.check_borrow(ptr); }
+
+  std::uint32_t shared_count(void *ptr) {
+    return checker_.shared_count(ptr) -
+           static_cast<std::uint32_t>(
+               std::count(released_.begin(), released_.end(), ptr));
+  }
+
+  void set_owned(void *ptr) { checker_.set_owned(ptr); }
+
+  bool check_owned(void *ptr) { return checker_.check_owned(ptr); }
+
+  BorrowStats stats() const { return checker_.stats(); }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::EpochBorrowChecker;
+#endif
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "ptr_map.h"
+#include "v2.h"
+
+namespace borrow {
+
+// Borrow checker that keeps an address out of its table until the address has
+// a second borrow. A first borrow is recorded in a small direct-mapped cache
+// of recent borrows; a second borrow of the same address, or another address
+// landing in the same cache entry, moves the record into the table. An object
+// that is only ever borrowed once at a time never reaches the table, and
+// while the table is empty a borrow does no hashing beyond picking its cache
+// entry.
+//
+// An address is in the cache or in the table, never both, so every answer is
+// read from exactly one record.
+//
+// Usable with the v2 wrappers, e.g. Ref<T, LazyBorrowChecker<>>.
+template <typename Storage = FlatStorage, std::size_t CacheEntries = 16>
+class LazyBorrowChecker {
+private:
+  static_assert(CacheEntries != 0 && (CacheEntries & (CacheEntries - 1)) == 0,
+                "CacheEntries must be a power of two");
+
+  struct Entry {
+    void *ptr = nullptr;
+    BorrowRecord record;
+  };
+
+  std::array<Entry, CacheEntries> cache_{};
+  typename Storage::template map_type<BorrowRecord> table_;
+
+  Entry &entry_for(void *ptr) {
+    return cache_[ptr_hash(ptr) & (CacheEntries - 1)];
+  }
+
+  BorrowRecord *table_find(void *ptr) {
+    return table_.size() == 0 ? nullptr : table_.find(ptr);
+  }
+
+  // Record for ptr wherever it lives, or nullptr.
+  BorrowRecord *find(void *ptr) {
+    Entry &entry = entry_for(ptr);
+    if (entry.ptr == ptr) {
+      return &entry.record;
+    }
+    return table_find(ptr);
+  }
+
+  // Moves a cached record into the table and frees its entry.
+  BorrowRecord &materialise(Entry &entry) {
+    BorrowRecord &record = table_.insert(entry.ptr, entry.record);
+    entry = Entry{};
+    return record;
+  }
+
+  // Record to take a new borrow of ptr on: a cached record is moved to the
+  // table, since it is about to hold a second borrow; an untracked address
+  // gets the cache entry.
+  BorrowRecord &record_for(void *ptr) {
+    Entry &entry = entry_for(ptr);
+    if (entry.ptr == ptr) {
+      return materialise(entry);
+    }
+    if (BorrowRecord *record = table_find(ptr)) {
+      return *record;
+    }
+    if (entry.ptr != nullptr) {
+      materialise(entry);
+    }
+    entry.ptr = ptr;
+    return entry.record;
+  }
+
+  void release(void *ptr, BorrowRecord &record, Entry &entry) {
+    if (record.word != 0) {
+      return;
+    }
+    if (&record == &entry.record) {
+      entry = Entry{};
+    } else {
+      table_.erase(ptr);
+    }
+  }
+
+public:
+  LazyBorrowChecker() = default;
+
+  LazyBorrowChecker(const LazyBorrowChecker &) = delete;
+  LazyBorrowChecker &operator=(const LazyBorrowChecker &) = delete;
+
+  void add_borrow(void *ptr, BorrowState state) {
+    record_for(ptr).acquire(state);
+  }
+
+  // Takes a borrow of the given kind unless it conflicts with the borrows
+  // already held on ptr; returns false on conflict.
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    BorrowRecord *record = find(ptr);
+    if (record != nullptr && !record->allows(state)) {
+      return false;
+    }
+    add_borrow(ptr, state);
+    return true;
+  }
+
+  // Releases one borrow of the given kind, dropping the record once the
+  // address has no borrows left.
+  void remove_borrow(void *ptr, BorrowState state) {
+    Entry &entry = entry_for(ptr);
+    if (BorrowRecord *record = find(ptr)) {
+      record->release(state);
+      release(ptr, *record, entry);
+    }
+  }
+
+  // Drops every borrow recorded for ptr.
+  void remove_borrow(void *ptr) {
+    Entry &entry = entry_for(ptr);
+    if (entry.ptr == ptr) {
+      entry = Entry{};
+    } else if (table_.size() != 0) {
+      table_.erase(ptr);
+    }
+  }
+
+  BorrowState check_borrow(void *ptr) {
+    BorrowRecord *record = find(ptr);
+    return record == nullptr ? BorrowState::Valid : record->state();
+  }
+
+  std::uint32_t shared_count(void *ptr) {
+    BorrowRecord *record = find(ptr);
+    return record == nullptr ? 0 : record->shared_count();
+  }
+
+  void set_owned(void *ptr) {
+    if (BorrowRecord *record = find(ptr)) {
+      record->acquire(BorrowState::Owned);
+    }
+  }
+
+  bool check_owned(void *ptr) {
+    BorrowRecord *record = find(ptr);
+    return record != nullptr && (record->word & BorrowRecord::kOwned) != 0;
+  }
+
+  // Addresses that have been moved into the table.
+  std::size_t table_size() const { return table_.size(); }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::LazyBorrowChecker;
+#endif
@@ -1,9 +1,10 @@
-//#include "v2.h"
+#include "v1.h"
+#include "v2.h"
 #include "version3.h"
 
 int main() {
 
-  start_v3();
+  v3::start_v3();
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace borrow {
+
+// Fixed set of worker threads with one task queue each. A worker takes tasks
+// from the back of its own queue and, once that is empty, steals from the
+// front of the others, so uneven tasks even out without a central queue.
+//
+// The thread calling run() works through tasks as well until its batch is
+// done, so a pool with no workers still runs everything, just serially.
+class WorkStealingPool {
+private:
+  // One call to run(): the callback every task invokes and the tasks still
+  // to finish.
+  struct Batch {
+    void *context;
+    void (*call)(void *context, std::size_t index);
+    std::atomic<std::size_t> remaining;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+  };
+
+  struct Task {
+    Batch *batch;
+    std::size_t index;
+  };
+
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<std::size_t> queued_{0};
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false; // guarded by wake_mutex_
+
+  bool pop(std::size_t self, Task &task) {
+    {
+      Queue &own = *queues_[self];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        task = own.tasks.back();
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (std::size_t i = 1; i < queues_.size(); ++i) {
+      Queue &victim = *queues_[(self + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.front();
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Runs one queued task, preferring queue self; returns false if there was
+  // none.
+  bool run_one(std::size_t self) {
+    Task task;
+    if (!pop(self, task)) {
+      return false;
+    }
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+    Batch &batch = *task.batch;
+#if defined(__cpp_exceptions)
+    try {
+      batch.call(batch.context, task.index);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(batch.error_mutex);
+      if (!batch.error) {
+        batch.error = std::current_exception();
+      }
+    }
+#else
+    batch.call(batch.context, task.index);
+#endif
+    batch.remaining.fetch_sub(1, std::memory_order_release);
+    return true;
+  }
+
+  void work(std::size_t self) {
+    for (;;) {
+      if (run_one(self)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_.wait(lock, [this] {
+        return stop_ || queued_.load(std::memory_order_relaxed) != 0;
+      });
+      if (stop_ && queued_.load(std::memory_order_relaxed) == 0) {
+        return;
+      }
+    }
+  }
+
+public:
+  explicit WorkStealingPool(
+      std::size_t workers = std::thread::hardware_concurrency()) {
+    std::size_t queues = std::max<std::size_t>(workers, 1);
+    for (std::size_t i = 0; i < queues; ++i) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    for (std::size_t i = 0; i < workers; ++i) {
+      workers_.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Worker threads, not counting callers of run().
+  std::size_t size() const { return workers_.size(); }
+
+  // Calls f(i) for every i in [0, count) across the pool and returns once
+  // all calls have finished. The first exception thrown by f is rethrown
+  // here after the rest of the batch has run.
+  template <typename F> void run(std::size_t count, F &&f) {
+    if (count == 0) {
+      return;
+    }
+    Batch batch{&f,
+                [](void *context, std::size_t index) {
+                  (*static_cast<std::remove_reference_t<F> *>(context))(index);
+                },
+                {count},
+                {},
+                {}};
+    for (std::size_t i = 0; i < count; ++i) {
+      Queue &queue = *queues_[i % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back({&batch, i});
+    }
+    queued_.fetch_add(count, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+    }
+    wake_.notify_all();
+    while (batch.remaining.load(std::memory_order_acquire) != 0) {
+      if (!run_one(0)) {
+        std::this_thread::yield();
+      }
+    }
+#if defined(__cpp_exceptions)
+    if (batch.error) {
+      std::rethrow_exception(batch.error);
+    }
+#endif
+  }
+};
+
+// Calls f on every element of an exclusive borrow of a contiguous range,
+// such as a MutableSliceRef or a BorrowVec RangeMutRef, splitting it into
+// chunks of chunk_size elements that the pool's workers take one at a time.
+// The caller's borrow already covers every element, so the workers run
+// without any borrow checks; a chunk_size of 0 picks four chunks per thread.
+template <typename Slice, typename F>
+void par_for_each(WorkStealingPool &pool, Slice &slice, F f,
+                  std::size_t chunk_size = 0) {
+  auto data = std::span(*slice);
+  if (chunk_size == 0) {
+    std::size_t pieces = 4 * (pool.size() + 1);
+    chunk_size = std::max<std::size_t>((data.size() + pieces - 1) / pieces, 1);
+  }
+  std::size_t count = (data.size() + chunk_size - 1) / chunk_size;
+  pool.run(count, [&](std::size_t i) {
+    std::size_t begin = i * chunk_size;
+    for (auto &element :
+         data.subspan(begin, std::min(chunk_size, data.size() - begin))) {
+      f(element);
+    }
+  });
+}
+
+// Runs f on each already split borrow, e.g. the result of chunks(), one
+// piece per task. The pieces stay owned by the caller and are released on
+// its thread.
+template <typename Piece, typename F>
+void par_for_each_chunk(WorkStealingPool &pool, std::vector<Piece> &pieces,
+                        F f) {
+  pool.run(pieces.size(), [&](std::size_t i) { f(pieces[i]); });
+}
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::WorkStealingPool;
+using borrow::par_for_each;
+using borrow::par_for_each_chunk;
+#endif
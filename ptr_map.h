@@ -0,0 +1,341 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <utility>
+
+#include "borrow_error.h"
+
+namespace borrow {
+
+// Heap addresses share their low bits (alignment) and high bits (arena), so
+// fold them through a 64-bit finaliser before masking.
+inline std::uint64_t ptr_hash64(const void *key) {
+  std::uint64_t x = reinterpret_cast<std::uintptr_t>(key);
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+inline std::size_t ptr_hash(const void *key) {
+  return static_cast<std::size_t>(ptr_hash64(key));
+}
+
+// Maps keyed on a borrowed address. Both expose the same small interface so
+// BorrowChecker can be parameterised on its storage:
+//   V *find(void *key)            -> nullptr when the key is absent
+//   V &insert(void *key, V value) -> key must not be present
+//   bool erase(void *key)         -> false when the key is absent
+//   std::size_t size() const
+//   std::size_t probe_length(void *key) const -> entries examined by a lookup
+
+// Node-based map, one heap allocation per tracked address.
+template <typename V> class UnorderedPtrMap {
+private:
+  std::unordered_map<void *, V> map_;
+
+public:
+  V *find(void *key) {
+    auto it = map_.find(key);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+
+  V &insert(void *key, V value) {
+    return map_.emplace(key, std::move(value)).first->second;
+  }
+
+  bool erase(void *key) { return map_.erase(key) != 0; }
+
+  void reserve(std::size_t n) { map_.reserve(n); }
+
+  std::size_t size() const { return map_.size(); }
+
+  std::size_t probe_length(void *key) const {
+    return map_.bucket_size(map_.bucket(key));
+  }
+};
+
+// Node-based map drawing its nodes from a std::pmr::memory_resource, e.g. a
+// monotonic or pool resource scoped to one request.
+template <typename V> class PmrPtrMap {
+private:
+  std::pmr::unordered_map<void *, V> map_;
+
+public:
+  explicit PmrPtrMap(
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : map_(resource) {}
+
+  V *find(void *key) {
+    auto it = map_.find(key);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+
+  V &insert(void *key, V value) {
+    return map_.emplace(key, std::move(value)).first->second;
+  }
+
+  bool erase(void *key) { return map_.erase(key) != 0; }
+
+  void reserve(std::size_t n) { map_.reserve(n); }
+
+  std::size_t size() const { return map_.size(); }
+
+  std::size_t probe_length(void *key) const {
+    return map_.bucket_size(map_.bucket(key));
+  }
+};
+
+// Open-addressing map with linear probing. Keys and values live in one flat
+// array, so a lookup touches a single cache line in the common case. Erase
+// shifts the following cluster back instead of leaving tombstones, keeping
+// probe sequences short under churn. nullptr is reserved as the empty key.
+template <typename V> class FlatPtrMap {
+private:
+  struct Slot {
+    void *key = nullptr;
+    V value{};
+  };
+
+  static constexpr std::size_t kMinCapacity = 16;
+
+  std::unique_ptr<Slot[]> slots_;
+  std::size_t mask_ = 0;
+  std::size_t size_ = 0;
+
+  std::size_t capacity() const { return slots_ ? mask_ + 1 : 0; }
+
+  void rehash(std::size_t capacity) {
+    std::size_t old_capacity = this->capacity();
+    std::unique_ptr<Slot[]> old = std::move(slots_);
+    slots_.reset(new Slot[capacity]);
+    mask_ = capacity - 1;
+    for (std::size_t i = 0; i < old_capacity; ++i) {
+      if (old[i].key != nullptr) {
+        std::size_t j = ptr_hash(old[i].key) & mask_;
+        while (slots_[j].key != nullptr) {
+          j = (j + 1) & mask_;
+        }
+        slots_[j] = std::move(old[i]);
+      }
+    }
+  }
+
+  // Keep the load factor at or below 1/2.
+  void grow_for(std::size_t n) {
+    std::size_t capacity = this->capacity();
+    if (n * 2 <= capacity) {
+      return;
+    }
+    if (capacity < kMinCapacity) {
+      capacity = kMinCapacity;
+    }
+    while (n * 2 > capacity) {
+      capacity *= 2;
+    }
+    rehash(capacity);
+  }
+
+  Slot *find_slot(void *key) {
+    if (key == nullptr || size_ == 0) {
+      return nullptr;
+    }
+    for (std::size_t i = ptr_hash(key) & mask_;; i = (i + 1) & mask_) {
+      if (slots_[i].key == key) {
+        return &slots_[i];
+      }
+      if (slots_[i].key == nullptr) {
+        return nullptr;
+      }
+    }
+  }
+
+public:
+  FlatPtrMap() = default;
+
+  FlatPtrMap(FlatPtrMap &&other) noexcept
+      : slots_(std::move(other.slots_)), mask_(std::exchange(other.mask_, 0)),
+        size_(std::exchange(other.size_, 0)) {}
+
+  FlatPtrMap &operator=(FlatPtrMap &&other) noexcept {
+    if (this != &other) {
+      slots_ = std::move(other.slots_);
+      mask_ = std::exchange(other.mask_, 0);
+      size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+  }
+
+  V *find(void *key) {
+    Slot *slot = find_slot(key);
+    return slot == nullptr ? nullptr : &slot->value;
+  }
+
+  V &insert(void *key, V value) {
+    assert(key != nullptr); // nullptr marks an empty slot
+    grow_for(size_ + 1);
+    std::size_t i = ptr_hash(key) & mask_;
+    while (slots_[i].key != nullptr) {
+      assert(slots_[i].key != key); // make sure the key doesn't already exist
+      i = (i + 1) & mask_;
+    }
+    slots_[i].key = key;
+    slots_[i].value = std::move(value);
+    ++size_;
+    return slots_[i].value;
+  }
+
+  bool erase(void *key) {
+    Slot *slot = find_slot(key);
+    if (slot == nullptr) {
+      return false;
+    }
+    // Backward-shift deletion: pull every later member of the cluster whose
+    // home slot is not between the hole and itself into the hole.
+    std::size_t hole = static_cast<std::size_t>(slot - slots_.get());
+    for (std::size_t i = (hole + 1) & mask_; slots_[i].key != nullptr;
+         i = (i + 1) & mask_) {
+      std::size_t home = ptr_hash(slots_[i].key) & mask_;
+      if (((i - home) & mask_) >= ((i - hole) & mask_)) {
+        slots_[hole] = std::move(slots_[i]);
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot{};
+    --size_;
+    return true;
+  }
+
+  void reserve(std::size_t n) { grow_for(n); }
+
+  std::size_t size() const { return size_; }
+
+  // Slots from the key's home slot up to and including the key or the empty
+  // slot that ends its cluster.
+  std::size_t probe_length(void *key) const {
+    if (size_ == 0) {
+      return 0;
+    }
+    std::size_t length = 1;
+    for (std::size_t i = ptr_hash(key) & mask_;
+         slots_[i].key != key && slots_[i].key != nullptr;
+         i = (i + 1) & mask_) {
+      ++length;
+    }
+    return length;
+  }
+};
+
+// Open-addressing map for at most N keys, stored inline with no heap
+// allocation: the fixed array of version3.h as a storage backend for the v2
+// engine. The table has room for twice N so probes stay short; inserting
+// the N+1th key throws std::runtime_error.
+template <typename V, std::size_t N> class FixedPtrMap {
+private:
+  struct Slot {
+    void *key = nullptr;
+    V value{};
+  };
+
+  static constexpr std::size_t kCapacity = std::bit_ceil(2 * N);
+  static constexpr std::size_t kMask = kCapacity - 1;
+
+  std::array<Slot, kCapacity> slots_{};
+  std::size_t size_ = 0;
+
+  Slot *find_slot(void *key) {
+    if (key == nullptr || size_ == 0) {
+      return nullptr;
+    }
+    for (std::size_t i = ptr_hash(key) & kMask;; i = (i + 1) & kMask) {
+      if (slots_[i].key == key) {
+        return &slots_[i];
+      }
+      if (slots_[i].key == nullptr) {
+        return nullptr;
+      }
+    }
+  }
+
+public:
+  V *find(void *key) {
+    Slot *slot = find_slot(key);
+    return slot == nullptr ? nullptr : &slot->value;
+  }
+
+  V &insert(void *key, V value) {
+    assert(key != nullptr); // nullptr marks an empty slot
+    if (size_ == N) {
+      borrow_error("borrow checker is full");
+    }
+    std::size_t i = ptr_hash(key) & kMask;
+    while (slots_[i].key != nullptr) {
+      assert(slots_[i].key != key); // make sure the key doesn't already exist
+      i = (i + 1) & kMask;
+    }
+    slots_[i].key = key;
+    slots_[i].value = std::move(value);
+    ++size_;
+    return slots_[i].value;
+  }
+
+  // Backward-shift deletion, as in FlatPtrMap.
+  bool erase(void *key) {
+    Slot *slot = find_slot(key);
+    if (slot == nullptr) {
+      return false;
+    }
+    std::size_t hole = static_cast<std::size_t>(slot - slots_.data());
+    for (std::size_t i = (hole + 1) & kMask; slots_[i].key != nullptr;
+         i = (i + 1) & kMask) {
+      std::size_t home = ptr_hash(slots_[i].key) & kMask;
+      if (((i - home) & kMask) >= ((i - hole) & kMask)) {
+        slots_[hole] = std::move(slots_[i]);
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot{};
+    --size_;
+    return true;
+  }
+
+  // The capacity is fixed; reserving only checks that n keys would fit.
+  void reserve(std::size_t n) {
+    if (n > N) {
+      borrow_error("borrow checker is full");
+    }
+  }
+
+  std::size_t size() const { return size_; }
+
+  std::size_t probe_length(void *key) const {
+    if (size_ == 0) {
+      return 0;
+    }
+    std::size_t length = 1;
+    for (std::size_t i = ptr_hash(key) & kMask;
+         slots_[i].key != key && slots_[i].key != nullptr;
+         i = (i + 1) & kMask) {
+      ++length;
+    }
+    return length;
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::ptr_hash64;
+using borrow::ptr_hash;
+using borrow::UnorderedPtrMap;
+using borrow::PmrPtrMap;
+using borrow::FlatPtrMap;
+using borrow::FixedPtrMap;
+#endif
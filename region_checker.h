@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "v2.h"
+
+namespace borrow {
+
+// Borrow checker keyed on address ranges rather than exact pointers, so a
+// borrow of one element and a borrow of a slice containing it see each other.
+//
+// Borrowed memory is kept as a sorted vector of disjoint segments, each with
+// the BorrowRecord of every region covering it. A query binary-searches to
+// the first segment it touches and walks only the segments it overlaps, so
+// the cost of borrowing a slice does not depend on its length.
+//
+// Ref<T, RegionBorrowChecker> and MutableRef borrow the sizeof(T) bytes of
+// their value through the region interface, so a Ref of a whole array and a
+// MutableRef of one element conflict, and both see SliceRef and
+// MutableSliceRef. The point interface (add_borrow(void *) etc.) treats an
+// address as a one-byte region.
+class RegionBorrowChecker {
+private:
+  struct Segment {
+    std::uintptr_t begin;
+    std::uintptr_t end;
+    BorrowRecord record;
+  };
+
+  std::vector<Segment> segments_;
+
+  static std::uintptr_t address(const void *ptr) {
+    return reinterpret_cast<std::uintptr_t>(ptr);
+  }
+
+  // Index of the first segment ending after x.
+  std::size_t first_after(std::uintptr_t x) const {
+    auto it = std::partition_point(
+        segments_.begin(), segments_.end(),
+        [x](const Segment &segment) { return segment.end <= x; });
+    return static_cast<std::size_t>(it - segments_.begin());
+  }
+
+  // Makes x a segment boundary if it falls strictly inside a segment.
+  void split_at(std::uintptr_t x) {
+    std::size_t i = first_after(x);
+    if (i < segments_.size() && segments_[i].begin < x) {
+      Segment tail = segments_[i];
+      tail.begin = x;
+      segments_[i].end = x;
+      segments_.insert(segments_.begin() + static_cast<std::ptrdiff_t>(i) + 1,
+                       tail);
+    }
+  }
+
+  // Drops empty segments and merges touching neighbours with the same record
+  // in [lo, hi), plus the segments on either side of it.
+  void compact(std::size_t lo, std::size_t hi) {
+    lo = lo == 0 ? 0 : lo - 1;
+    hi = std::min(hi + 1, segments_.size());
+    std::size_t out = lo;
+    for (std::size_t i = lo; i < hi; ++i) {
+      if (segments_[i].record.word == 0) {
+        continue;
+      }
+      if (out > lo && segments_[out - 1].end == segments_[i].begin &&
+          segments_[out - 1].record.word == segments_[i].record.word) {
+        segments_[out - 1].end = segments_[i].end;
+        continue;
+      }
+      segments_[out++] = segments_[i];
+    }
+    segments_.erase(segments_.begin() + static_cast<std::ptrdiff_t>(out),
+                    segments_.begin() + static_cast<std::ptrdiff_t>(hi));
+  }
+
+  void acquire(std::uintptr_t begin, std::uintptr_t end, BorrowState state) {
+    split_at(begin);
+    split_at(end);
+    std::size_t lo = first_after(begin);
+    // Fill the gaps between existing segments so the whole range is covered,
+    // then take the borrow on every segment in it.
+    std::uintptr_t cursor = begin;
+    std::size_t i = lo;
+    while (cursor < end) {
+      if (i == segments_.size() || segments_[i].begin >= end ||
+          segments_[i].begin > cursor) {
+        std::uintptr_t gap_end =
+            i < segments_.size() ? std::min(segments_[i].begin, end) : end;
+        segments_.insert(segments_.begin() + static_cast<std::ptrdiff_t>(i),
+                         Segment{cursor, gap_end, {}});
+      }
+      segments_[i].record.acquire(state);
+      cursor = segments_[i].end;
+      ++i;
+    }
+    compact(lo, i);
+  }
+
+public:
+  RegionBorrowChecker() = default;
+
+  // Borrows [base, base + length) unless it overlaps a conflicting borrow:
+  // shared regions may overlap each other, a mutable region overlaps nothing.
+  bool try_add_region(const void *base, std::size_t length, BorrowState state) {
+    if (length == 0) {
+      return true;
+    }
+    std::uintptr_t begin = address(base);
+    std::uintptr_t end = begin + length;
+    for (std::size_t i = first_after(begin);
+         i < segments_.size() && segments_[i].begin < end; ++i) {
+      if (!segments_[i].record.allows(state)) {
+        return false;
+      }
+    }
+    acquire(begin, end, state);
+    return true;
+  }
+
+  void add_region(const void *base, std::size_t length, BorrowState state) {
+    if (length != 0) {
+      acquire(address(base), address(base) + length, state);
+    }
+  }
+
+  void remove_region(const void *base, std::size_t length, BorrowState state) {
+    if (length == 0) {
+      return;
+    }
+    std::uintptr_t begin = address(base);
+    std::uintptr_t end = begin + length;
+    split_at(begin);
+    split_at(end);
+    std::size_t lo = first_after(begin);
+    std::size_t hi = lo;
+    for (; hi < segments_.size() && segments_[hi].begin < end; ++hi) {
+      segments_[hi].record.release(state);
+    }
+    compact(lo, hi);
+  }
+
+  // Strongest borrow held on any byte of [base, base + length).
+  BorrowState check_region(const void *base, std::size_t length) const {
+    if (length == 0) {
+      return BorrowState::Valid;
+    }
+    std::uintptr_t begin = address(base);
+    std::uintptr_t end = begin + length;
+    BorrowState result = BorrowState::Valid;
+    for (std::size_t i = first_after(begin);
+         i < segments_.size() && segments_[i].begin < end; ++i) {
+      BorrowState state = segments_[i].record.state();
+      if (state == BorrowState::MutableBorrowed) {
+        return state;
+      }
+      if (state == BorrowState::Owned) {
+        result = state;
+      }
+    }
+    return result;
+  }
+
+  std::size_t segment_count() const { return segments_.size(); }
+
+  void add_borrow(void *ptr, BorrowState state) { add_region(ptr, 1, state); }
+
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    return try_add_region(ptr, 1, state);
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    remove_region(ptr, 1, state);
+  }
+
+  BorrowState check_borrow(void *ptr) { return check_region(ptr, 1); }
+};
+
+// Shared borrow of a contiguous range of elements.
+template <typename T, typename Checker = RegionBorrowChecker> class SliceRef {
+private:
+  std::span<T> data_;
+  Checker *borrow_checker_;
+
+public:
+  SliceRef(std::span<T> data, Checker *borrow_checker)
+      : data_(data), borrow_checker_(borrow_checker) {
+    assert(borrow_checker_ !=
+           nullptr); // make sure borrow_checker is not nullptr
+    if (!borrow_checker_->try_add_region(data_.data(), data_.size_bytes(),
+                                         BorrowState::Valid)) {
+      fail_borrow(
+          {BorrowErrc::SharedWhileMutable, BorrowState::MutableBorrowed});
+    }
+  }
+
+  SliceRef(const SliceRef &) = delete;
+  SliceRef &operator=(const SliceRef &) = delete;
+
+  SliceRef(SliceRef &&other) noexcept
+      : data_(std::exchange(other.data_, {})),
+        borrow_checker_(other.borrow_checker_) {}
+
+  ~SliceRef() {
+    borrow_checker_->remove_region(data_.data(), data_.size_bytes(),
+                                   BorrowState::Valid);
+  }
+
+  std::span<const T> operator*() const { return data_; }
+
+  const T &operator[](std::size_t i) const { return data_[i]; }
+
+  std::size_t size() const { return data_.size(); }
+
+  auto begin() const { return std::span<const T>(data_).begin(); }
+
+  auto end() const { return std::span<const T>(data_).end(); }
+};
+
+// Exclusive borrow of a contiguous range of elements.
+template <typename T, typename Checker = RegionBorrowChecker>
+class MutableSliceRef {
+private:
+  struct Adopt {};
+
+  std::span<T> data_;
+  Checker *borrow_checker_;
+
+  // Takes over part of a region the caller already holds mutably. Releasing
+  // it releases just that part, so the pieces of a split borrow can be
+  // dropped in any order.
+  MutableSliceRef(std::span<T> data, Checker *borrow_checker, Adopt)
+      : data_(data), borrow_checker_(borrow_checker) {
+    assert(data_.empty() ||
+           borrow_checker_->check_region(data_.data(), data_.size_bytes()) ==
+               BorrowState::MutableBorrowed); // make sure the region is held
+  }
+
+public:
+  MutableSliceRef(std::span<T> data, Checker *borrow_checker)
+      : data_(data), borrow_checker_(borrow_checker) {
+    assert(borrow_checker_ !=
+           nullptr); // make sure borrow_checker is not nullptr
+    if (!borrow_checker_->try_add_region(data_.data(), data_.size_bytes(),
+                                         BorrowState::MutableBorrowed)) {
+      fail_borrow({BorrowErrc::MutableWhileBorrowed,
+                   borrow_checker_->check_region(data_.data(),
+                                                 data_.size_bytes())});
+    }
+  }
+
+  MutableSliceRef(const MutableSliceRef &) = delete;
+  MutableSliceRef &operator=(const MutableSliceRef &) = delete;
+
+  MutableSliceRef(MutableSliceRef &&other) noexcept
+      : data_(std::exchange(other.data_, {})),
+        borrow_checker_(other.borrow_checker_) {}
+
+  ~MutableSliceRef() {
+    borrow_checker_->remove_region(data_.data(), data_.size_bytes(),
+                                   BorrowState::MutableBorrowed);
+  }
+
+  std::span<T> operator*() const { return data_; }
+
+  T &operator[](std::size_t i) const { return data_[i]; }
+
+  std::size_t size() const { return data_.size(); }
+
+  auto begin() const { return data_.begin(); }
+
+  auto end() const { return data_.end(); }
+
+  // Splits the borrow into [0, n) and [n, size()), like Rust's
+  // split_at_mut. The halves are disjoint by construction, so the checker is
+  // not consulted; each half releases its own part when dropped.
+  std::pair<MutableSliceRef, MutableSliceRef> split_at(std::size_t n) && {
+    assert(n <= data_.size()); // make sure the split point is in range
+    std::span<T> data = std::exchange(data_, {});
+    return {MutableSliceRef(data.first(n), borrow_checker_, Adopt{}),
+            MutableSliceRef(data.subspan(n), borrow_checker_, Adopt{})};
+  }
+
+  // Splits the borrow into consecutive pieces of chunk_size elements, the
+  // last one possibly shorter.
+  std::vector<MutableSliceRef> chunks(std::size_t chunk_size) && {
+    assert(chunk_size != 0); // make sure chunks are not empty
+    std::span<T> data = std::exchange(data_, {});
+    std::vector<MutableSliceRef> pieces;
+    pieces.reserve((data.size() + chunk_size - 1) / chunk_size);
+    for (std::size_t i = 0; i < data.size(); i += chunk_size) {
+      pieces.push_back(MutableSliceRef(
+          data.subspan(i, std::min(chunk_size, data.size() - i)),
+          borrow_checker_, Adopt{}));
+    }
+    return pieces;
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::RegionBorrowChecker;
+using borrow::SliceRef;
+using borrow::MutableSliceRef;
+#endif
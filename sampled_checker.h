@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "ptr_map.h"
+#include "v2.h"
+
+namespace borrow {
+
+// Which borrows a SampledBorrowChecker recorded: the address when the borrow
+// went through the wrapped checker, nullptr when it was skipped.
+struct SampledBorrow {
+  void *ptr = nullptr;
+};
+
+// Borrow checker that only checks a fraction of addresses, for paths where
+// checking every borrow costs too much but switching checks off loses the
+// safety net. Whether an address is checked depends on a hash of it, so all
+// borrows of one value are either checked together or skipped together and
+// an aliasing bug on a checked value is caught every time it happens; over
+// many values a bug is caught with probability equal to the rate. A skipped
+// borrow costs a hash and a compare.
+//
+// The rate can be changed at any time, from any thread. Raising it only adds
+// addresses, and each Ref remembers in its token whether its borrow was
+// recorded, so borrows taken at the old rate are still released correctly.
+//
+// Usable with the v2 wrappers, e.g. Ref<T, SampledBorrowChecker<>>.
+template <typename Checker = FlatBorrowChecker> class SampledBorrowChecker {
+public:
+  using handle_type = SampledBorrow;
+
+private:
+  static constexpr std::uint64_t kAll = std::uint64_t{1} << 32;
+
+  Checker checker_;
+  // Addresses whose hash, scaled to 32 bits, is below this are checked.
+  std::atomic<std::uint64_t> threshold_;
+
+  static std::uint64_t threshold_for(double rate) {
+    if (!(rate > 0)) {
+      return 0;
+    }
+    if (rate >= 1) {
+      return kAll;
+    }
+    return static_cast<std::uint64_t>(rate * static_cast<double>(kAll));
+  }
+
+public:
+  // Checks every address until the rate is lowered.
+  explicit SampledBorrowChecker(double rate = 1.0)
+      : threshold_(threshold_for(rate)) {}
+
+  SampledBorrowChecker(const SampledBorrowChecker &) = delete;
+  SampledBorrowChecker &operator=(const SampledBorrowChecker &) = delete;
+
+  // Fraction of addresses to check, from 0 (none) to 1 (all).
+  void set_sample_rate(double rate) {
+    threshold_.store(threshold_for(rate), std::memory_order_relaxed);
+  }
+
+  double sample_rate() const {
+    return static_cast<double>(threshold_.load(std::memory_order_relaxed)) /
+           static_cast<double>(kAll);
+  }
+
+  // Whether borrows of ptr are checked at the current rate.
+  bool sampled(const void *ptr) const {
+    // The full 64-bit hash, so the top 32 bits exist whatever size_t is.
+    std::uint64_t bucket = ptr_hash64(ptr) >> 32;
+    return bucket < threshold_.load(std::memory_order_relaxed);
+  }
+
+  // The wrapped checker, which holds the records of checked addresses.
+  Checker &checker() { return checker_; }
+
+  bool try_add_borrow(void *ptr, BorrowState state, SampledBorrow &handle) {
+    if (!sampled(ptr)) {
+      handle.ptr = nullptr;
+      return true;
+    }
+    if (!checker_.try_add_borrow(ptr, state)) {
+      return false;
+    }
+    handle.ptr = ptr;
+    return true;
+  }
+
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    SampledBorrow handle;
+    return try_add_borrow(ptr, state, handle);
+  }
+
+  void add_borrow(void *ptr, BorrowState state) {
+    if (sampled(ptr)) {
+      checker_.add_borrow(ptr, state);
+    }
+  }
+
+  // Releases a borrow through the handle it was taken with; skipped borrows
+  // have nothing to release.
+  void remove_borrow(SampledBorrow handle, BorrowState state) {
+    if (handle.ptr != nullptr) {
+      checker_.remove_borrow(handle.ptr, state);
+    }
+  }
+
+  // Without a handle the rate may have changed since the borrow was taken,
+  // so the wrapped checker is always asked; it ignores untracked addresses.
+  void remove_borrow(void *ptr, BorrowState state) {
+    checker_.remove_borrow(ptr, state);
+  }
+
+  void remove_borrow(void *ptr) { checker_.remove_borrow(ptr); }
+
+  BorrowState check_borrow(void *ptr) { return checker_.check_borrow(ptr); }
+
+  std::uint32_t shared_count(void *ptr) { return checker_.shared_count(ptr); }
+
+  void set_owned(void *ptr) {
+    if (sampled(ptr)) {
+      checker_.set_owned(ptr);
+    }
+  }
+
+  bool check_owned(void *ptr) { return checker_.check_owned(ptr); }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::SampledBorrow;
+using borrow::SampledBorrowChecker;
+#endif
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "ptr_map.h"
+#include "v2.h"
+
+namespace borrow {
+
+// Borrow checker with scopes whose borrows are released all at once. Inside
+// a BorrowScope, scope.borrow(ptr) and scope.borrow_mut(ptr) take a borrow
+// that lasts until the scope ends and hand back a plain reference: nothing
+// is released per borrow, and closing the scope forgets all of them with a
+// generation bump instead of one erase each.
+//
+// Each open scope records its borrows in a table of its own, stamped with a
+// generation; slots from an earlier generation read as empty, so clearing
+// the table is a counter increment. Scopes nest as a stack, and a borrow is
+// checked against every open scope and against the ordinary borrows, which
+// are kept in the wrapped BasicBorrowChecker and work as usual, e.g.
+// Ref<T, ScopedBorrowChecker<>>. With no scope open the checker costs the
+// same as the one it wraps.
+template <typename Storage = FlatStorage> class ScopedBorrowChecker {
+private:
+  // Records of one scope: open addressing, no erase, cleared by generation.
+  class ScopeTable {
+  private:
+    struct Slot {
+      void *key = nullptr;
+      BorrowRecord record;
+      std::uint32_t generation = 0;
+    };
+
+    static constexpr std::size_t kMinCapacity = 16;
+
+    std::vector<Slot> slots_;
+    std::size_t size_ = 0;
+    std::uint32_t generation_ = 1;
+
+    bool live(const Slot &slot) const { return slot.generation == generation_; }
+
+    void grow() {
+      std::vector<Slot> old = std::move(slots_);
+      slots_.assign(old.empty() ? kMinCapacity : old.size() * 2, Slot{});
+      std::size_t mask = slots_.size() - 1;
+      for (const Slot &slot : old) {
+        if (live(slot)) {
+          std::size_t i = ptr_hash(slot.key) & mask;
+          while (live(slots_[i])) {
+            i = (i + 1) & mask;
+          }
+          slots_[i] = slot;
+        }
+      }
+    }
+
+  public:
+    BorrowRecord *find(void *key) {
+      if (size_ == 0) {
+        return nullptr;
+      }
+      std::size_t mask = slots_.size() - 1;
+      for (std::size_t i = ptr_hash(key) & mask; live(slots_[i]);
+           i = (i + 1) & mask) {
+        if (slots_[i].key == key) {
+          return &slots_[i].record;
+        }
+      }
+      return nullptr;
+    }
+
+    BorrowRecord &find_or_insert(void *key) {
+      if (BorrowRecord *record = find(key)) {
+        return *record;
+      }
+      // Keep the load factor at or below 1/2.
+      if ((size_ + 1) * 2 > slots_.size()) {
+        grow();
+      }
+      std::size_t mask = slots_.size() - 1;
+      std::size_t i = ptr_hash(key) & mask;
+      while (live(slots_[i])) {
+        i = (i + 1) & mask;
+      }
+      slots_[i] = {key, {}, generation_};
+      ++size_;
+      return slots_[i].record;
+    }
+
+    void clear() {
+      size_ = 0;
+      if (++generation_ == 0) {
+        // The stamp wrapped: stale slots could match again, so wipe them.
+        slots_.assign(slots_.size(), Slot{});
+        generation_ = 1;
+      }
+    }
+
+    std::size_t size() const { return size_; }
+  };
+
+  BasicBorrowChecker<Storage> checker_;
+  // Tables of closed scopes stay allocated for the next scope at that depth.
+  std::vector<ScopeTable> scopes_;
+  std::size_t depth_ = 0;
+
+  // Borrows of ptr held by the open scopes, folded into one record.
+  BorrowRecord scoped(void *ptr) {
+    BorrowRecord result;
+    for (std::size_t d = 0; d < depth_; ++d) {
+      if (BorrowRecord *record = scopes_[d].find(ptr)) {
+        result.word = ((result.word | record->word) & BorrowRecord::kMutable) |
+                      (result.shared_count() + record->shared_count());
+      }
+    }
+    return result;
+  }
+
+  // Everything held on ptr: ordinary borrows and scoped ones.
+  BorrowRecord combined(void *ptr) {
+    BorrowRecord result = checker_.record(ptr);
+    if (depth_ != 0) {
+      BorrowRecord held = scoped(ptr);
+      result.word = (result.word | (held.word & BorrowRecord::kMutable)) +
+                    held.shared_count();
+    }
+    return result;
+  }
+
+public:
+  ScopedBorrowChecker() = default;
+
+  ScopedBorrowChecker(const ScopedBorrowChecker &) = delete;
+  ScopedBorrowChecker &operator=(const ScopedBorrowChecker &) = delete;
+
+  ~ScopedBorrowChecker() {
+    assert(depth_ == 0); // make sure every scope was closed
+  }
+
+  // Pushes a scope; see BorrowScope.
+  void open_scope() {
+    if (depth_ == scopes_.size()) {
+      scopes_.emplace_back();
+    }
+    ++depth_;
+  }
+
+  // Pops the innermost scope, releasing every borrow taken in it.
+  void close_scope() {
+    assert(depth_ != 0); // make sure a scope is open
+    scopes_[--depth_].clear();
+  }
+
+  std::size_t depth() const { return depth_; }
+
+  // Borrows held by the innermost scope, counting each address once.
+  std::size_t scoped_count() const {
+    return depth_ == 0 ? 0 : scopes_[depth_ - 1].size();
+  }
+
+  // Takes a borrow of ptr that lasts until the innermost scope closes;
+  // returns false on conflict.
+  bool try_add_scoped(void *ptr, BorrowState state) {
+    assert(depth_ != 0); // make sure a scope is open
+    if (!combined(ptr).allows(state)) {
+      return false;
+    }
+    scopes_[depth_ - 1].find_or_insert(ptr).acquire(state);
+    return true;
+  }
+
+  void add_borrow(void *ptr, BorrowState state) {
+    checker_.add_borrow(ptr, state);
+  }
+
+  // Takes an ordinary borrow, checked against the open scopes as well.
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    if (depth_ != 0 && !scoped(ptr).allows(state)) {
+      return false;
+    }
+    return checker_.try_add_borrow(ptr, state);
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    checker_.remove_borrow(ptr, state);
+  }
+
+  // Drops every ordinary borrow recorded for ptr; scoped borrows last until
+  // their scope closes.
+  void remove_borrow(void *ptr) { checker_.remove_borrow(ptr); }
+
+  BorrowState check_borrow(void *ptr) { return combined(ptr).state(); }
+
+  std::uint32_t shared_count(void *ptr) {
+    return combined(ptr).shared_count();
+  }
+
+  void set_owned(void *ptr) { checker_.set_owned(ptr); }
+
+  bool check_owned(void *ptr) { return checker_.check_owned(ptr); }
+};
+
+// Opens a scope on a ScopedBorrowChecker for its lifetime. Scopes must close
+// in the reverse order they were opened, which C++ scoping gives for free.
+//
+//   BorrowScope scope(&checker);
+//   const Request &request = scope.borrow(&pending);
+//   Response &response = scope.borrow_mut(&out);
+//   ... // both released together at the closing brace
+template <typename Checker> class BorrowScope {
+private:
+  Checker *borrow_checker_;
+  std::size_t depth_;
+
+public:
+  explicit BorrowScope(Checker *borrow_checker)
+      : borrow_checker_(borrow_checker) {
+    assert(borrow_checker_ !=
+           nullptr); // make sure borrow_checker is not nullptr
+    borrow_checker_->open_scope();
+    depth_ = borrow_checker_->depth();
+  }
+
+  BorrowScope(const BorrowScope &) = delete;
+  BorrowScope &operator=(const BorrowScope &) = delete;
+
+  ~BorrowScope() {
+    assert(borrow_checker_->depth() == depth_); // make sure scopes nest
+    borrow_checker_->close_scope();
+  }
+
+  template <typename T> const T &borrow(T *data) {
+    if (!borrow_checker_->try_add_scoped(data, BorrowState::Valid)) {
+      fail_borrow(
+          {BorrowErrc::SharedWhileMutable, BorrowState::MutableBorrowed});
+    }
+    return *data;
+  }
+
+  template <typename T> T &borrow_mut(T *data) {
+    if (!borrow_checker_->try_add_scoped(data, BorrowState::MutableBorrowed)) {
+      fail_borrow({BorrowErrc::MutableWhileBorrowed,
+                   borrow_checker_->check_borrow(data)});
+    }
+    return *data;
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::ScopedBorrowChecker;
+using borrow::BorrowScope;
+#endif
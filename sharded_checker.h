@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "borrow_error.h"
+#include "ptr_map.h"
+#include "v2.h"
+
+namespace borrow {
+
+// Borrow checker for values that stay on the thread that created them. Each
+// thread records its borrows in its own unsynchronised table, so Ref and
+// MutableRef never touch shared memory or take a lock. Only a value whose Own
+// is handed to another thread with Own::send_to_thread() is recorded in the
+// shared directory, and only until the receiving thread calls
+// Sendable::receive(), which moves it into that thread's table.
+//
+// As with Rust's Send, a value belongs to one thread at a time: borrows must
+// be taken on the thread that currently owns it, since borrows recorded by
+// different threads are not checked against each other. A value in transit
+// can be borrowed from any thread and must no longer be borrowed when it is
+// received. Its directory entry marks it as in transit whatever its borrow
+// count, so it is only removed by receive() or drop_sent().
+//
+// Tables belong to the checker and are freed with it, so a thread that exits
+// leaves its (by then empty) table behind until the checker is destroyed.
+//
+// Usable with the v2 wrappers, e.g. Ref<T, ShardedBorrowChecker>.
+class ShardedBorrowChecker {
+private:
+  using Table = FlatPtrMap<BorrowRecord>;
+
+  // A thread's table for one checker; checker ids are never reused, so an
+  // entry left behind by a destroyed checker can't match a later one.
+  struct CachedTable {
+    std::uint64_t checker_id;
+    Table *table;
+    std::weak_ptr<Table> owner;
+  };
+
+  std::uint64_t id_;
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Table>> tables_; // guarded by mutex_
+  Table directory_;                            // guarded by mutex_
+  std::atomic<std::size_t> in_transit_{0};
+
+  static std::uint64_t next_id() {
+    static std::atomic<std::uint64_t> next{1};
+    return next.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Table &local() {
+    thread_local std::vector<CachedTable> cache;
+    for (const CachedTable &entry : cache) {
+      if (entry.checker_id == id_) {
+        return *entry.table;
+      }
+    }
+    return attach(cache);
+  }
+
+  // First use of this checker on the calling thread: creates its table and
+  // forgets the tables of checkers that have since been destroyed.
+  Table &attach(std::vector<CachedTable> &cache) {
+    std::erase_if(cache,
+                  [](const CachedTable &entry) { return entry.owner.expired(); });
+    auto table = std::make_shared<Table>();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tables_.push_back(table);
+    }
+    cache.push_back({id_, table.get(), table});
+    return *table;
+  }
+
+  // Calls f(table, record) with the table holding ptr and its record: the
+  // calling thread's table first, then the directory under its lock. An
+  // untracked ptr is reported as the local table and a null record.
+  template <typename F> decltype(auto) with_record(void *ptr, F &&f) {
+    Table &table = local();
+    if (BorrowRecord *record = table.find(ptr)) {
+      return f(table, record);
+    }
+    if (in_transit_.load(std::memory_order_acquire) != 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (BorrowRecord *record = directory_.find(ptr)) {
+        return f(directory_, record);
+      }
+    }
+    return f(table, nullptr);
+  }
+
+  // Takes ptr out of transit. Called with mutex_ held.
+  void erase_sent(void *ptr) {
+    if (directory_.erase(ptr)) {
+      in_transit_.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+public:
+  ShardedBorrowChecker() : id_(next_id()) {}
+
+  ShardedBorrowChecker(const ShardedBorrowChecker &) = delete;
+  ShardedBorrowChecker &operator=(const ShardedBorrowChecker &) = delete;
+
+  void add_borrow(void *ptr, BorrowState state) {
+    with_record(ptr, [&](Table &table, BorrowRecord *record) {
+      if (record == nullptr) {
+        record = &table.insert(ptr, BorrowRecord{});
+      }
+      record->acquire(state);
+    });
+  }
+
+  // Takes a borrow of the given kind unless it conflicts with the borrows
+  // already held on ptr; returns false on conflict.
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    return with_record(ptr, [&](Table &table, BorrowRecord *record) {
+      if (record == nullptr) {
+        record = &table.insert(ptr, BorrowRecord{});
+      } else if (!record->allows(state)) {
+        return false;
+      }
+      record->acquire(state);
+      return true;
+    });
+  }
+
+  // Releases one borrow of the given kind, dropping the record once the
+  // address has no borrows left.
+  void remove_borrow(void *ptr, BorrowState state) {
+    with_record(ptr, [&](Table &table, BorrowRecord *record) {
+      if (record == nullptr) {
+        return;
+      }
+      record->release(state);
+      if (record->word == 0 && &table != &directory_) {
+        table.erase(ptr);
+      }
+    });
+  }
+
+  // Drops every borrow recorded for ptr.
+  void remove_borrow(void *ptr) {
+    with_record(ptr, [&](Table &table, BorrowRecord *record) {
+      if (record == nullptr) {
+        return;
+      }
+      if (&table == &directory_) {
+        record->word = 0;
+      } else {
+        table.erase(ptr);
+      }
+    });
+  }
+
+  BorrowState check_borrow(void *ptr) {
+    return with_record(ptr, [](Table &, BorrowRecord *record) {
+      return record == nullptr ? BorrowState::Valid : record->state();
+    });
+  }
+
+  std::uint32_t shared_count(void *ptr) {
+    return with_record(ptr, [](Table &, BorrowRecord *record) {
+      return record == nullptr ? 0 : record->shared_count();
+    });
+  }
+
+  void set_owned(void *ptr) {
+    with_record(ptr, [](Table &, BorrowRecord *record) {
+      if (record != nullptr) {
+        record->acquire(BorrowState::Owned);
+      }
+    });
+  }
+
+  bool check_owned(void *ptr) {
+    return with_record(ptr, [](Table &, BorrowRecord *record) {
+      return record != nullptr && (record->word & BorrowRecord::kOwned) != 0;
+    });
+  }
+
+  // Moves ptr's record from the calling thread's table to the directory.
+  // Throws if ptr is still borrowed.
+  void send(void *ptr) {
+    Table &table = local();
+    std::uint32_t word = 0;
+    if (BorrowRecord *record = table.find(ptr)) {
+      word = record->word;
+    }
+    if ((word & ~BorrowRecord::kOwned) != 0) {
+      borrow_error("cannot send a value while it is borrowed");
+    }
+    table.erase(ptr);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (directory_.find(ptr) == nullptr) {
+      directory_.insert(ptr, BorrowRecord{word});
+      in_transit_.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  // Moves ptr's record from the directory to the calling thread's table.
+  // Throws if a borrow taken while ptr was in transit is still held.
+  void receive(void *ptr) {
+    std::uint32_t word = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (BorrowRecord *record = directory_.find(ptr)) {
+        word = record->word;
+        if ((word & ~BorrowRecord::kOwned) != 0) {
+          borrow_error("cannot receive a value while it is borrowed");
+        }
+        erase_sent(ptr);
+      }
+    }
+    if (word != 0) {
+      local().insert(ptr, BorrowRecord{word});
+    }
+  }
+
+  // Takes ptr out of transit without receiving it, borrowed or not; for a
+  // value that is destroyed on the way. Never throws.
+  void drop_sent(void *ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    erase_sent(ptr);
+  }
+
+  // Values sent and not yet received.
+  std::size_t in_transit() const {
+    return in_transit_.load(std::memory_order_acquire);
+  }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::ShardedBorrowChecker;
+#endif
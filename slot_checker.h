@@ -0,0 +1,261 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ptr_map.h"
+#include "v2.h"
+
+namespace borrow {
+
+// Names one record of a SlotBorrowChecker. The generation changes every time
+// the slot is freed, so a handle that outlived its borrow no longer matches.
+struct BorrowHandle {
+  std::uint32_t index = 0;
+  std::uint32_t generation = 0;
+};
+
+// Borrow checker whose records live in a slot array and are handed out as
+// BorrowHandles. The v2 wrappers keep the handle they were given, so
+// releasing a borrow is an indexed write with no hash lookup; only the first
+// borrow of an address goes through the address index.
+//
+// Freed slots keep their address until they are reused, and the index entry
+// for that address is dropped only then. Release therefore never touches the
+// index, the index never holds more entries than there are slots, and
+// borrowing an address again soon after its last release takes its old slot
+// back off the free list with a single lookup.
+//
+// A slot can also be pinned for the Weak observers of an owned value, see
+// Own::downgrade(): it then stays live with no borrows held and is freed,
+// bumping its generation, only when the owner drops every record for the
+// address. A Weak compares its handle's generation to decide whether the
+// value still exists.
+//
+// Usable with the v2 wrappers, e.g. Ref<T, SlotBorrowChecker>.
+class SlotBorrowChecker {
+public:
+  using handle_type = BorrowHandle;
+
+private:
+  static constexpr std::uint32_t kNoSlot = ~std::uint32_t{0};
+
+  struct Slot {
+    void *ptr = nullptr;
+    BorrowRecord record;
+    std::uint32_t generation = 0;
+    std::uint32_t next_free = kNoSlot;
+    std::uint32_t prev_free = kNoSlot;
+    bool pinned = false;
+  };
+
+  std::vector<Slot> slots_;
+  FlatPtrMap<std::uint32_t> index_;
+  std::uint32_t free_ = kNoSlot;
+
+  // Whether the slot is off the free list: borrowed, owned or pinned.
+  static bool in_use(const Slot &slot) {
+    return slot.record.word != 0 || slot.pinned;
+  }
+
+  // Live slot holding ptr, or nullptr.
+  Slot *slot_of(void *ptr) {
+    std::uint32_t *index = index_.find(ptr);
+    if (index == nullptr) {
+      return nullptr;
+    }
+    Slot &slot = slots_[*index];
+    return slot.ptr == ptr && in_use(slot) ? &slot : nullptr;
+  }
+
+  void unlink_free(std::uint32_t index) {
+    Slot &slot = slots_[index];
+    if (slot.prev_free == kNoSlot) {
+      free_ = slot.next_free;
+    } else {
+      slots_[slot.prev_free].next_free = slot.next_free;
+    }
+    if (slot.next_free != kNoSlot) {
+      slots_[slot.next_free].prev_free = slot.prev_free;
+    }
+  }
+
+  // A slot for an address with no live record: the one it had last if that
+  // hasn't been reused, otherwise any free slot or a new one.
+  std::uint32_t claim(void *ptr) {
+    std::uint32_t *entry = index_.find(ptr);
+    if (entry != nullptr && slots_[*entry].ptr == ptr) {
+      unlink_free(*entry);
+      return *entry;
+    }
+    std::uint32_t index;
+    if (free_ != kNoSlot) {
+      index = free_;
+      unlink_free(index);
+      // The slot's previous address is still indexed to it.
+      Slot &slot = slots_[index];
+      std::uint32_t *stale = index_.find(slot.ptr);
+      if (stale != nullptr && *stale == index) {
+        index_.erase(slot.ptr);
+        // Erasing may have moved the entry for ptr.
+        entry = index_.find(ptr);
+      }
+      slot.ptr = ptr;
+    } else {
+      index = static_cast<std::uint32_t>(slots_.size());
+      slots_.push_back({ptr, {}, 0, kNoSlot, kNoSlot, false});
+    }
+    if (entry != nullptr) {
+      *entry = index;
+    } else {
+      index_.insert(ptr, index);
+    }
+    return index;
+  }
+
+  void free_slot(std::uint32_t index) {
+    Slot &slot = slots_[index];
+    slot.record = BorrowRecord{};
+    slot.pinned = false;
+    ++slot.generation;
+    slot.prev_free = kNoSlot;
+    slot.next_free = free_;
+    if (free_ != kNoSlot) {
+      slots_[free_].prev_free = index;
+    }
+    free_ = index;
+  }
+
+  BorrowHandle handle_of(const Slot &slot) const {
+    return {static_cast<std::uint32_t>(&slot - slots_.data()), slot.generation};
+  }
+
+  Slot &slot_for(void *ptr) {
+    std::uint32_t *index = index_.find(ptr);
+    if (index != nullptr && slots_[*index].ptr == ptr &&
+        in_use(slots_[*index])) {
+      return slots_[*index];
+    }
+    return slots_[claim(ptr)];
+  }
+
+public:
+  SlotBorrowChecker() = default;
+
+  SlotBorrowChecker(const SlotBorrowChecker &) = delete;
+  SlotBorrowChecker &operator=(const SlotBorrowChecker &) = delete;
+
+  // Whether handle still names the borrow it was issued for.
+  bool is_live(BorrowHandle handle) const {
+    return handle.index < slots_.size() &&
+           slots_[handle.index].generation == handle.generation &&
+           slots_[handle.index].record.word != 0;
+  }
+
+  // Keeps ptr's slot live until remove_borrow(ptr) and returns its handle;
+  // pinning an address again returns the same handle.
+  BorrowHandle pin(void *ptr) {
+    Slot &slot = slot_for(ptr);
+    slot.pinned = true;
+    return handle_of(slot);
+  }
+
+  // Whether the slot a pinned handle names has not been freed since. One
+  // compare of generations, no lookup.
+  bool is_pinned(BorrowHandle handle) const {
+    return handle.index < slots_.size() &&
+           slots_[handle.index].generation == handle.generation;
+  }
+
+  BorrowHandle add_borrow(void *ptr, BorrowState state) {
+    Slot &slot = slot_for(ptr);
+    slot.record.acquire(state);
+    BorrowHandle handle = handle_of(slot);
+    if (!in_use(slot)) {
+      free_slot(handle.index);
+    }
+    return handle;
+  }
+
+  // Takes a borrow of the given kind unless it conflicts with the borrows
+  // already held on ptr; on success handle names the record.
+  bool try_add_borrow(void *ptr, BorrowState state, BorrowHandle &handle) {
+    Slot *slot = slot_of(ptr);
+    if (slot != nullptr && !slot->record.allows(state)) {
+      return false;
+    }
+    handle = add_borrow(ptr, state);
+    return true;
+  }
+
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    BorrowHandle handle;
+    return try_add_borrow(ptr, state, handle);
+  }
+
+  // Releases one borrow of the given kind through its handle, freeing the
+  // slot once nothing is left. A stale handle, e.g. one released twice after
+  // its slot was freed, trips an assertion and is otherwise ignored.
+  void remove_borrow(BorrowHandle handle, BorrowState state) {
+    assert(is_live(handle)); // make sure the handle is not stale
+    if (!is_live(handle)) {
+      return;
+    }
+    Slot &slot = slots_[handle.index];
+    slot.record.release(state);
+    if (!in_use(slot)) {
+      free_slot(handle.index);
+    }
+  }
+
+  void remove_borrow(void *ptr, BorrowState state) {
+    if (Slot *slot = slot_of(ptr)) {
+      remove_borrow(handle_of(*slot), state);
+    }
+  }
+
+  // Drops every borrow recorded for ptr.
+  void remove_borrow(void *ptr) {
+    if (Slot *slot = slot_of(ptr)) {
+      free_slot(handle_of(*slot).index);
+    }
+  }
+
+  BorrowState check_borrow(BorrowHandle handle) const {
+    return is_live(handle) ? slots_[handle.index].record.state()
+                           : BorrowState::Valid;
+  }
+
+  BorrowState check_borrow(void *ptr) {
+    Slot *slot = slot_of(ptr);
+    return slot == nullptr ? BorrowState::Valid : slot->record.state();
+  }
+
+  std::uint32_t shared_count(void *ptr) {
+    Slot *slot = slot_of(ptr);
+    return slot == nullptr ? 0 : slot->record.shared_count();
+  }
+
+  void set_owned(void *ptr) {
+    if (Slot *slot = slot_of(ptr)) {
+      slot->record.acquire(BorrowState::Owned);
+    }
+  }
+
+  bool check_owned(void *ptr) {
+    Slot *slot = slot_of(ptr);
+    return slot != nullptr && (slot->record.word & BorrowRecord::kOwned) != 0;
+  }
+
+  // Slots allocated so far, live or free.
+  std::size_t slot_count() const { return slots_.size(); }
+};
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::BorrowHandle;
+using borrow::SlotBorrowChecker;
+#endif
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "v2.h"
+
+namespace borrow {
+
+class TaskBorrowChecker;
+
+// A borrow held by a task, as reported when another borrow conflicts with it.
+struct BorrowHolder {
+  std::uint64_t task;
+  BorrowState state;
+};
+
+// One coroutine's view of a TaskBorrowChecker. Borrows taken through a
+// BorrowTask are recorded against the task rather than the thread, so a Ref
+// held across co_await still belongs to its suspended task while other tasks
+// run on the same thread, and a conflicting borrow can name the task that
+// holds it.
+//
+// Keep the BorrowTask in the coroutine frame (as a local or in the promise)
+// and pass it to the v2 wrappers as their checker:
+//
+//   BorrowTask task(executor_checker);
+//   MutableRef<Session, BorrowTask> session(&s, &task);
+//   co_await read_request();   // still holds session
+//
+// Nothing happens on suspend or resume: the task's borrows are only looked at
+// when a borrow conflicts. The executor's tasks run on one thread, so at
+// that point every other holder is a suspended task.
+class BorrowTask {
+private:
+  struct Held {
+    void *ptr;
+    BorrowState state;
+  };
+
+  TaskBorrowChecker *checker_;
+  std::uint64_t id_;
+  std::vector<Held> held_;
+  std::vector<BorrowHolder> last_conflict_;
+
+  friend class TaskBorrowChecker;
+
+  void forget(void *ptr, BorrowState state) {
+    // Borrows are usually released in reverse order, so search from the back.
+    for (std::size_t i = held_.size(); i-- > 0;) {
+      if (held_[i].ptr == ptr && held_[i].state == state) {
+        held_.erase(held_.begin() + static_cast<std::ptrdiff_t>(i));
+        return;
+      }
+    }
+  }
+
+public:
+  explicit BorrowTask(TaskBorrowChecker &checker);
+
+  BorrowTask(const BorrowTask &) = delete;
+  BorrowTask &operator=(const BorrowTask &) = delete;
+
+  ~BorrowTask();
+
+  std::uint64_t id() const { return id_; }
+
+  // Borrows this task currently holds, across suspensions.
+  std::size_t held() const { return held_.size(); }
+
+  // Holders of the borrows that made this task's last try_add_borrow fail,
+  // this task included if it conflicted with itself.
+  const std::vector<BorrowHolder> &last_conflict() const {
+    return last_conflict_;
+  }
+
+  void add_borrow(void *ptr, BorrowState state);
+
+  bool try_add_borrow(void *ptr, BorrowState state);
+
+  void remove_borrow(void *ptr, BorrowState state);
+
+  void remove_borrow(void *ptr);
+
+  BorrowState check_borrow(void *ptr);
+
+  std::uint32_t shared_count(void *ptr);
+
+  void set_owned(void *ptr);
+
+  bool check_owned(void *ptr);
+};
+
+// Borrow checker for the tasks of one single-threaded executor. The records
+// are an ordinary FlatBorrowChecker; on top of it the checker knows its live
+// BorrowTasks, so holders(ptr) can list which tasks hold borrows of ptr. That
+// walk is only done when asked, typically after a conflict.
+class TaskBorrowChecker {
+private:
+  FlatBorrowChecker checker_;
+  std::vector<BorrowTask *> tasks_;
+  std::uint64_t next_id_ = 1;
+
+  friend class BorrowTask;
+
+  std::uint64_t attach(BorrowTask *task) {
+    tasks_.push_back(task);
+    return next_id_++;
+  }
+
+  void detach(BorrowTask *task) { std::erase(tasks_, task); }
+
+public:
+  TaskBorrowChecker() = default;
+
+  TaskBorrowChecker(const TaskBorrowChecker &) = delete;
+  TaskBorrowChecker &operator=(const TaskBorrowChecker &) = delete;
+
+  ~TaskBorrowChecker() {
+    assert(tasks_.empty()); // make sure no task outlives its checker
+  }
+
+  std::size_t task_count() const { return tasks_.size(); }
+
+  // Every task holding a borrow of ptr, with the kind of borrow it holds.
+  std::vector<BorrowHolder> holders(void *ptr) const {
+    std::vector<BorrowHolder> result;
+    for (const BorrowTask *task : tasks_) {
+      for (const BorrowTask::Held &held : task->held_) {
+        if (held.ptr == ptr) {
+          result.push_back({task->id_, held.state});
+        }
+      }
+    }
+    return result;
+  }
+
+  // Holders of ptr whose borrows conflict with a new borrow of the given
+  // kind: every holder for an exclusive borrow, mutable holders otherwise.
+  std::vector<BorrowHolder> conflicts(void *ptr, BorrowState state) const {
+    std::vector<BorrowHolder> result = holders(ptr);
+    if (state != BorrowState::MutableBorrowed) {
+      std::erase_if(result, [](const BorrowHolder &holder) {
+        return holder.state != BorrowState::MutableBorrowed;
+      });
+    }
+    return result;
+  }
+
+  BorrowState check_borrow(void *ptr) { return checker_.check_borrow(ptr); }
+
+  std::uint32_t shared_count(void *ptr) { return checker_.shared_count(ptr); }
+};
+
+inline BorrowTask::BorrowTask(TaskBorrowChecker &checker)
+    : checker_(&checker), id_(checker.attach(this)) {}
+
+// Releases whatever the task still holds, so a task that is cancelled or
+// torn down with borrows outstanding doesn't leave its values locked for the
+// other tasks. The task's wrappers must not be released after this.
+inline BorrowTask::~BorrowTask() {
+  for (const Held &held : held_) {
+    checker_->checker_.remove_borrow(held.ptr, held.state);
+  }
+  checker_->detach(this);
+}
+
+inline void BorrowTask::add_borrow(void *ptr, BorrowState state) {
+  checker_->checker_.add_borrow(ptr, state);
+  held_.push_back({ptr, state});
+}
+
+inline bool BorrowTask::try_add_borrow(void *ptr, BorrowState state) {
+  if (!checker_->checker_.try_add_borrow(ptr, state)) {
+    last_conflict_ = checker_->conflicts(ptr, state);
+    return false;
+  }
+  held_.push_back({ptr, state});
+  return true;
+}
+
+inline void BorrowTask::remove_borrow(void *ptr, BorrowState state) {
+  checker_->checker_.remove_borrow(ptr, state);
+  forget(ptr, state);
+}
+
+// Drops every borrow recorded for ptr, including those of other tasks.
+inline void BorrowTask::remove_borrow(void *ptr) {
+  checker_->checker_.remove_borrow(ptr);
+  for (BorrowTask *task : checker_->tasks_) {
+    std::erase_if(task->held_, [ptr](const Held &held) {
+      return held.ptr == ptr;
+    });
+  }
+}
+
+inline BorrowState BorrowTask::check_borrow(void *ptr) {
+  return checker_->checker_.check_borrow(ptr);
+}
+
+inline std::uint32_t BorrowTask::shared_count(void *ptr) {
+  return checker_->checker_.shared_count(ptr);
+}
+
+inline void BorrowTask::set_owned(void *ptr) {
+  checker_->checker_.set_owned(ptr);
+}
+
+inline bool BorrowTask::check_owned(void *ptr) {
+  return checker_->checker_.check_owned(ptr);
+}
+
+} // namespace borrow
+
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::BorrowHolder;
+using borrow::BorrowTask;
+using borrow::TaskBorrowChecker;
+#endif
@@ -0,0 +1,74 @@
+// Batch borrows through BasicBorrowChecker::try_add_borrows and borrow_all.
+#include <cassert>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "../v2.h"
+
+template <typename Checker> void shared_batches_allow_repeats() {
+  Checker checker;
+  int a = 0;
+  int b = 0;
+  std::vector<int *> ptrs = {&a, &b, &a};
+  {
+    auto set = checker.borrow_all(ptrs);
+    assert(checker.shared_count(&a) == 2);
+    assert(checker.shared_count(&b) == 1);
+  }
+  assert(checker.shared_count(&a) == 0);
+  assert(checker.check_borrow(&a) == BorrowState::Valid);
+}
+
+template <typename Checker> void exclusive_batches_reject_repeats() {
+  Checker checker;
+  int a = 0;
+  int b = 0;
+  std::vector<int *> ptrs = {&a, &b, &a};
+  assert(!checker.try_add_borrows(std::span<int *const>(ptrs),
+                                  BorrowState::MutableBorrowed));
+  // Nothing from the refused batch is held.
+  assert(checker.check_borrow(&a) == BorrowState::Valid);
+  assert(checker.check_borrow(&b) == BorrowState::Valid);
+
+  std::vector<int *> distinct = {&a, &b};
+  assert(checker.try_add_borrows(std::span<int *const>(distinct),
+                                 BorrowState::MutableBorrowed));
+  assert(checker.check_borrow(&a) == BorrowState::MutableBorrowed);
+  assert(!checker.try_add_borrows(std::span<int *const>(distinct),
+                                  BorrowState::Valid));
+  checker.remove_borrows(std::span<int *const>(distinct),
+                         BorrowState::MutableBorrowed);
+  assert(checker.check_borrow(&b) == BorrowState::Valid);
+}
+
+// A full fixed-size table only refuses batches that need new records, and
+// refuses them before borrowing anything.
+void fixed_batches_count_new_addresses() {
+  BasicBorrowChecker<FixedStorage<4>> checker;
+  int values[5] = {};
+  std::vector<int *> ptrs = {&values[0], &values[1], &values[2], &values[3]};
+  auto first = checker.borrow_all(ptrs);
+  auto second = checker.borrow_all(ptrs);
+  assert(checker.shared_count(&values[0]) == 2);
+
+  std::vector<int *> overflow = {&values[3], &values[4]};
+  bool refused = false;
+  try {
+    checker.borrow_all(overflow);
+  } catch (const std::runtime_error &) {
+    refused = true;
+  }
+  assert(refused);
+  assert(checker.shared_count(&values[3]) == 2);
+  assert(checker.check_borrow(&values[4]) == BorrowState::Valid);
+}
+
+int main() {
+  shared_batches_allow_repeats<BorrowChecker>();
+  shared_batches_allow_repeats<FlatBorrowChecker>();
+  exclusive_batches_reject_repeats<BorrowChecker>();
+  exclusive_batches_reject_repeats<FlatBorrowChecker>();
+  fixed_batches_count_new_addresses();
+  return 0;
+}
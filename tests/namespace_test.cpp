@@ -0,0 +1,48 @@
+// Built with BORROW_NO_GLOBAL_NAMES: the headers must leave the global
+// namespace alone, so these global names don't clash with theirs.
+#include <cassert>
+
+#include "../borrow.h"
+#include "../borrow_vec.h"
+#include "../epoch_checker.h"
+#include "../lazy_checker.h"
+#include "../parallel.h"
+#include "../region_checker.h"
+#include "../sampled_checker.h"
+#include "../scope_checker.h"
+#include "../slot_checker.h"
+#include "../task_checker.h"
+#include "../v1.h"
+#include "../version3.h"
+
+struct BorrowState {};
+struct BorrowChecker {};
+template <typename T> struct Ref {};
+template <typename T> struct Own {};
+struct FlatPtrMap {};
+int try_borrow = 0;
+
+int main() {
+  using Engine = borrow::Engine<>;
+  Engine::Checker checker;
+  Engine::Own<int> own(new int(1), &checker);
+  {
+    Engine::Ref<int> ref(own.get(), &checker);
+    auto exclusive = borrow::try_borrow_mut(own.get(), &checker);
+    assert(!exclusive);
+    assert(exclusive.error().held == borrow::BorrowState::Valid);
+  }
+  assert(borrow::try_borrow_mut(own.get(), &checker));
+
+  borrow::ScopedBorrowChecker<> scoped;
+  int value = 0;
+  {
+    borrow::BorrowScope<borrow::ScopedBorrowChecker<>> scope(&scoped);
+    scope.borrow_mut(&value) = 2;
+  }
+  assert(scoped.depth() == 0 && value == 2);
+
+  Ref<int> decoy;
+  (void)decoy;
+  return try_borrow;
+}
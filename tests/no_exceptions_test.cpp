@@ -0,0 +1,92 @@
+// Built with -fno-exceptions: the headers must compile without exceptions,
+// and conflicts are reported through the try_* functions instead.
+#include <cassert>
+
+#include "../borrow.h"
+#include "../borrow_vec.h"
+#include "../parallel.h"
+#include "../region_checker.h"
+#include "../v1.h"
+#include "../v2.h"
+#include "../version3.h"
+
+void v2_conflicts() {
+  FlatBorrowChecker checker;
+  int value = 0;
+  {
+    auto exclusive = try_borrow_mut(&value, &checker);
+    assert(exclusive.has_value());
+    auto shared = try_borrow(&value, &checker);
+    assert(!shared);
+    assert(shared.error().code == BorrowErrc::SharedWhileMutable);
+    assert(shared.error().held == BorrowState::MutableBorrowed);
+  }
+  auto first = try_borrow(&value, &checker);
+  auto second = try_borrow_mut(&value, &checker);
+  assert(first && !second);
+  assert(second.error().code == BorrowErrc::MutableWhileBorrowed);
+}
+
+struct KeepValue {
+  void operator()(int *) const {}
+};
+
+void v3_conflicts() {
+  v3::BorrowChecker<int, 1> checker;
+  int value = 0;
+  {
+    auto exclusive = v3::MutableRef<int>::try_borrow_mut(value, checker);
+    assert(exclusive.has_value());
+    auto again = v3::MutableRef<int>::try_borrow_mut(value, checker);
+    assert(!again);
+    assert(again.error().code == BorrowErrc::MutableWhileBorrowed);
+    assert(again.error().held == BorrowState::MutableBorrowed);
+    auto shared = v3::Ref<int, 1>::try_borrow(&value, &checker);
+    assert(!shared);
+    assert(shared.error().code == BorrowErrc::SharedWhileMutable);
+  }
+  assert((v3::Ref<int, 1>::try_borrow(&value, &checker)));
+
+  // A borrowed Own frees the value too, so neither may delete it here.
+  v3::Own<int, 1, KeepValue> own(&value, &checker);
+  auto owned = own.try_borrow<1>();
+  assert(owned.has_value());
+  auto twice = own.try_borrow<1>();
+  assert(!twice);
+  assert(twice.error().held == BorrowState::Owned);
+}
+
+// The checkers and containers outside v2.h, on paths that don't fail.
+void extensions() {
+  int value = 0;
+  borrow::Engine<borrow::StoragePolicy::Flat,
+                 borrow::ThreadPolicy::Atomic>::Checker atomic(16);
+  {
+    auto exclusive = try_borrow_mut(&value, &atomic);
+    assert(exclusive && !try_borrow(&value, &atomic));
+  }
+
+  ShardedBorrowChecker sharded;
+  Own<int, ShardedBorrowChecker> own(new int(1), &sharded);
+  own.send_to_thread().receive();
+
+  BorrowVec<int> values(8, 1);
+  {
+    auto whole = values.borrow_range_mut(0, values.size());
+    WorkStealingPool pool(1);
+    par_for_each(pool, whole, [](int &element) { element *= 2; });
+  }
+  assert(*values.borrow(3) == 2);
+  assert(std::move(values).into_vector().size() == 8);
+
+  v1::BorrowChecker legacy;
+  v1::Ref<int> ref(&value, &legacy);
+  assert(*ref == 0);
+}
+
+int main() {
+  v2_conflicts();
+  v3_conflicts();
+  extensions();
+  return 0;
+}
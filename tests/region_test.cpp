@@ -0,0 +1,52 @@
+// Wrappers over RegionBorrowChecker borrow the whole of their value.
+#include <array>
+#include <cassert>
+
+#include "../region_checker.h"
+
+using Region = RegionBorrowChecker;
+
+void whole_ref_rejects_element_mut() {
+  Region checker;
+  std::array<int, 4> values = {};
+  {
+    Ref<std::array<int, 4>, Region> whole(&values, &checker);
+    auto element = try_borrow_mut(&values[2], &checker);
+    assert(!element);
+    assert(element.error().code == BorrowErrc::MutableWhileBorrowed);
+    assert(element.error().held == BorrowState::Valid);
+    // Shared borrows of the whole and of an element may overlap.
+    assert(try_borrow(&values[2], &checker));
+  }
+  assert(try_borrow_mut(&values[2], &checker));
+  assert(checker.segment_count() == 0);
+}
+
+void element_mut_rejects_whole_ref() {
+  Region checker;
+  std::array<int, 4> values = {};
+  MutableRef<int, Region> element(&values[3], &checker);
+  auto whole = try_borrow(&values, &checker);
+  assert(!whole);
+  assert(whole.error().code == BorrowErrc::SharedWhileMutable);
+  // Neighbouring elements are still free.
+  assert(try_borrow_mut(&values[2], &checker));
+}
+
+void whole_mut_rejects_slice() {
+  Region checker;
+  std::array<int, 4> values = {};
+  auto whole = try_borrow_mut(&values, &checker);
+  assert(whole);
+  assert(checker.check_region(&values[1], sizeof(int)) ==
+         BorrowState::MutableBorrowed);
+  assert(!checker.try_add_region(&values[1], 2 * sizeof(int),
+                                 BorrowState::Valid));
+}
+
+int main() {
+  whole_ref_rejects_element_mut();
+  element_mut_rejects_whole_ref();
+  whole_mut_rejects_slice();
+  return 0;
+}
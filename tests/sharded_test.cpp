@@ -0,0 +1,55 @@
+// Values handed between threads through ShardedBorrowChecker.
+#include <cassert>
+#include <thread>
+
+#include "../sharded_checker.h"
+
+using SendOwn = Own<int, ShardedBorrowChecker>;
+
+// A borrow taken and released while the value is in transit must not end
+// its transit: later borrows from other threads are still checked against
+// each other and receive() still finds the value.
+void borrow_then_release_in_transit() {
+  ShardedBorrowChecker checker;
+  SendOwn own(new int(1), &checker);
+  int *value = own.get();
+  auto sent = own.send_to_thread();
+  assert(checker.in_transit() == 1);
+
+  std::thread([&] {
+    { Ref<int, ShardedBorrowChecker> ref(value, &checker); }
+    assert(checker.in_transit() == 1);
+    MutableRef<int, ShardedBorrowChecker> held(value, &checker);
+    std::thread([&] {
+      assert(!checker.try_add_borrow(value, BorrowState::Valid));
+    }).join();
+  }).join();
+
+  std::thread([&] {
+    SendOwn received = sent.receive();
+    assert(checker.in_transit() == 0);
+    MutableRef<int, ShardedBorrowChecker> ref(received.get(), &checker);
+    *ref = 2;
+  }).join();
+}
+
+// Dropping a Sendable whose value is still borrowed frees it without
+// throwing out of the destructor.
+void drop_while_borrowed() {
+  ShardedBorrowChecker checker;
+  int *value;
+  {
+    SendOwn own(new int(1), &checker);
+    value = own.get();
+    auto sent = own.send_to_thread();
+    assert(checker.try_add_borrow(value, BorrowState::Valid));
+  }
+  assert(checker.in_transit() == 0);
+  checker.remove_borrow(value, BorrowState::Valid);
+}
+
+int main() {
+  borrow_then_release_in_transit();
+  drop_while_borrowed();
+  return 0;
+}
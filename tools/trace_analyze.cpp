@@ -0,0 +1,316 @@
+// Offline reader for borrow trace dumps written by
+// BorrowTraceRecorder::dump(). Replays the events in time order and reports:
+//
+//   - every borrow that blocked others, with the conflicts it caused, so a
+//     "cannot borrow as mutable more than once" can be traced back to the
+//     thread and call site that held the value;
+//   - how long shared, mutable and owned borrows were held, as power-of-two
+//     histograms.
+//
+// Caller addresses can be resolved with addr2line against the traced binary.
+//
+// Usage: trace_analyze <trace file> [max conflicts shown per borrow]
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../borrow_trace.h"
+
+namespace {
+
+// Order matches BorrowState in v2.h.
+const char *state_name(std::uint8_t state) {
+  switch (state) {
+  case 0:
+    return "shared";
+  case 1:
+    return "invalid";
+  case 2:
+    return "mutable";
+  case 3:
+    return "owned";
+  }
+  return "?";
+}
+
+struct OpenBorrow {
+  std::size_t id;
+  const BorrowTraceRecord *taken;
+};
+
+struct Borrow {
+  const BorrowTraceRecord *taken;
+  const BorrowTraceRecord *released = nullptr;
+};
+
+// An open borrow that made other borrows of its address fail.
+struct Blocker {
+  std::size_t id;
+  std::vector<const BorrowTraceRecord *> blocked;
+};
+
+constexpr std::size_t kBuckets = 40;
+
+struct Histogram {
+  std::array<std::uint64_t, kBuckets> counts{};
+  std::uint64_t total = 0;
+
+  void add(double ns) {
+    std::size_t bucket = 0;
+    while (bucket + 1 < kBuckets && ns >= static_cast<double>(2ull << bucket)) {
+      ++bucket;
+    }
+    ++counts[bucket];
+    ++total;
+  }
+
+  void print(const char *name) const {
+    if (total == 0) {
+      return;
+    }
+    std::printf("\n%s borrows held (%llu released):\n", name,
+                static_cast<unsigned long long>(total));
+    std::uint64_t peak = *std::max_element(counts.begin(), counts.end());
+    for (std::size_t b = 0; b < kBuckets; ++b) {
+      if (counts[b] == 0) {
+        continue;
+      }
+      int bar = static_cast<int>(40 * counts[b] / peak);
+      std::printf("  < %12llu ns %10llu %.*s\n",
+                  static_cast<unsigned long long>(2ull << b),
+                  static_cast<unsigned long long>(counts[b]), bar > 0 ? bar : 1,
+                  "########################################");
+    }
+  }
+};
+
+class Replay {
+private:
+  double ticks_per_ns_;
+  std::uint64_t origin_;
+  std::unordered_map<std::uint64_t, std::vector<OpenBorrow>> open_;
+  std::vector<Blocker> blockers_;
+  std::unordered_map<std::size_t, std::size_t> blocker_of_; // id -> blocker
+  std::vector<Borrow> taken_; // every borrow, by id
+  std::array<Histogram, 4> held_;
+  std::uint64_t conflicts_ = 0;
+  std::uint64_t unmatched_ = 0;
+
+  double us(std::uint64_t ticks) const {
+    return static_cast<double>(ticks - origin_) / ticks_per_ns_ / 1000.0;
+  }
+
+  void add(const BorrowTraceRecord &record) {
+    open_[record.address].push_back({taken_.size(), &record});
+    taken_.push_back({&record});
+  }
+
+  // Releases go to the oldest matching borrow taken on the same thread, or
+  // failing that on any thread, since a moved Ref may be dropped elsewhere.
+  void remove(const BorrowTraceRecord &record) {
+    auto it = open_.find(record.address);
+    if (it == open_.end()) {
+      ++unmatched_;
+      return;
+    }
+    std::vector<OpenBorrow> &borrows = it->second;
+    auto match = std::find_if(borrows.begin(), borrows.end(),
+                              [&](const OpenBorrow &open) {
+                                return open.taken->state == record.state &&
+                                       open.taken->thread == record.thread;
+                              });
+    if (match == borrows.end()) {
+      match = std::find_if(borrows.begin(), borrows.end(),
+                           [&](const OpenBorrow &open) {
+                             return open.taken->state == record.state;
+                           });
+    }
+    if (match == borrows.end()) {
+      ++unmatched_;
+      return;
+    }
+    taken_[match->id].released = &record;
+    if (record.state < held_.size()) {
+      held_[record.state].add(
+          static_cast<double>(record.timestamp - match->taken->timestamp) /
+          ticks_per_ns_);
+    }
+    borrows.erase(match);
+    if (borrows.empty()) {
+      open_.erase(it);
+    }
+  }
+
+  void remove_all(const BorrowTraceRecord &record) {
+    auto it = open_.find(record.address);
+    if (it == open_.end()) {
+      return;
+    }
+    for (const OpenBorrow &open : it->second) {
+      taken_[open.id].released = &record;
+    }
+    open_.erase(it);
+  }
+
+  // Charges the conflict to every open borrow it could have collided with.
+  void conflict(const BorrowTraceRecord &record) {
+    ++conflicts_;
+    auto it = open_.find(record.address);
+    if (it == open_.end()) {
+      ++unmatched_;
+      return;
+    }
+    for (const OpenBorrow &open : it->second) {
+      bool collides = record.state == 2 || open.taken->state == 2;
+      if (!collides) {
+        continue;
+      }
+      auto [entry, inserted] =
+          blocker_of_.try_emplace(open.id, blockers_.size());
+      if (inserted) {
+        blockers_.push_back({open.id, {}});
+      }
+      blockers_[entry->second].blocked.push_back(&record);
+    }
+  }
+
+public:
+  Replay(double ticks_per_ns, std::uint64_t origin)
+      : ticks_per_ns_(ticks_per_ns), origin_(origin) {}
+
+  void apply(const BorrowTraceRecord &record) {
+    switch (record.event) {
+    case BorrowTraceEvent::Add:
+      add(record);
+      break;
+    case BorrowTraceEvent::Remove:
+      remove(record);
+      break;
+    case BorrowTraceEvent::RemoveAll:
+      remove_all(record);
+      break;
+    case BorrowTraceEvent::Conflict:
+      conflict(record);
+      break;
+    }
+  }
+
+  void report(std::size_t records, std::size_t shown) {
+    std::printf("%zu events, %llu conflicts", records,
+                static_cast<unsigned long long>(conflicts_));
+    if (unmatched_ != 0) {
+      std::printf(", %llu events with no matching borrow (older events were "
+                  "overwritten)",
+                  static_cast<unsigned long long>(unmatched_));
+    }
+    std::printf("\n");
+
+    std::sort(blockers_.begin(), blockers_.end(),
+              [](const Blocker &a, const Blocker &b) {
+                return a.blocked.size() > b.blocked.size();
+              });
+    for (const Blocker &blocker : blockers_) {
+      const BorrowTraceRecord &taken = *taken_[blocker.id].taken;
+      const BorrowTraceRecord *released = taken_[blocker.id].released;
+      std::printf("\n%s borrow of 0x%llx by thread %u at %.3f us "
+                  "(caller 0x%llx)",
+                  state_name(taken.state),
+                  static_cast<unsigned long long>(taken.address), taken.thread,
+                  us(taken.timestamp),
+                  static_cast<unsigned long long>(taken.caller));
+      if (released != nullptr) {
+        std::printf(", held %.3f us\n",
+                    static_cast<double>(released->timestamp -
+                                        taken.timestamp) /
+                        ticks_per_ns_ / 1000.0);
+      } else {
+        std::printf(", still held at end of trace\n");
+      }
+      std::printf("  blocked %zu borrows:\n", blocker.blocked.size());
+      for (std::size_t i = 0; i < blocker.blocked.size() && i < shown; ++i) {
+        const BorrowTraceRecord &wanted = *blocker.blocked[i];
+        std::printf("    %s by thread %u at %.3f us (caller 0x%llx)\n",
+                    state_name(wanted.state), wanted.thread,
+                    us(wanted.timestamp),
+                    static_cast<unsigned long long>(wanted.caller));
+      }
+      if (blocker.blocked.size() > shown) {
+        std::printf("    ... %zu more\n", blocker.blocked.size() - shown);
+      }
+    }
+
+    held_[0].print("Shared");
+    held_[2].print("Mutable");
+    held_[3].print("Owned");
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <trace file> [max shown]\n", argv[0]);
+    return 2;
+  }
+  std::size_t shown = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10;
+
+  int fd = ::open(argv[1], O_RDONLY);
+  struct stat info;
+  if (fd < 0 || ::fstat(fd, &info) != 0) {
+    std::perror(argv[1]);
+    return 1;
+  }
+  std::size_t size = static_cast<std::size_t>(info.st_size);
+  if (size < sizeof(BorrowTraceHeader)) {
+    std::fprintf(stderr, "%s: not a borrow trace\n", argv[1]);
+    return 1;
+  }
+  void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    std::perror(argv[1]);
+    return 1;
+  }
+
+  BorrowTraceHeader header;
+  std::memcpy(&header, mapping, sizeof(header));
+  if (std::memcmp(header.magic, BorrowTraceHeader::kMagic,
+                  sizeof(header.magic)) != 0 ||
+      header.version != BorrowTraceHeader::kVersion ||
+      header.record_size != sizeof(BorrowTraceRecord) ||
+      sizeof(header) + header.record_count * sizeof(BorrowTraceRecord) >
+          size) {
+    std::fprintf(stderr, "%s: not a borrow trace this tool can read\n",
+                 argv[1]);
+    return 1;
+  }
+
+  // Per-thread runs are each in order; merge them by time stamp.
+  std::vector<BorrowTraceRecord> records(header.record_count);
+  std::memcpy(records.data(),
+              static_cast<const unsigned char *>(mapping) + sizeof(header),
+              records.size() * sizeof(BorrowTraceRecord));
+  ::munmap(mapping, size);
+  std::stable_sort(records.begin(), records.end(),
+                   [](const BorrowTraceRecord &a, const BorrowTraceRecord &b) {
+                     return a.timestamp < b.timestamp;
+                   });
+
+  Replay replay(header.ticks_per_ns > 0 ? header.ticks_per_ns : 1.0,
+                records.empty() ? 0 : records.front().timestamp);
+  for (const BorrowTraceRecord &record : records) {
+    replay.apply(record);
+  }
+  replay.report(records.size(), shown);
+  return 0;
+}
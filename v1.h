@@ -1,28 +1,87 @@
+#pragma once
+
 #include <cassert>
+#include <cstdint>
 #include <exception>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "borrow_error.h"
+
+// First generation of the checker. Its names live in namespace v1 so it can be
+// included next to v2.h and version3.h.
+namespace v1 {
+
 enum class BorrowState { Valid, Invalid, MutableBorrowed };
 
+// Borrow state of one tracked address packed into a single word: the low 31
+// bits count shared borrows, the top bit flags an exclusive borrow. Any number
+// of Refs to the same address share one record.
+struct BorrowRecord {
+  static constexpr std::uint32_t kMutable = 1u << 31;
+  static constexpr std::uint32_t kShared = kMutable - 1;
+
+  std::uint32_t word = 0;
+
+  BorrowState state() const {
+    return (word & kMutable) ? BorrowState::MutableBorrowed
+                             : BorrowState::Valid;
+  }
+
+  std::uint32_t shared_count() const { return word & kShared; }
+};
+
 class BorrowChecker {
 private:
-  std::unordered_map<void *, BorrowState> borrow_map_;
+  std::unordered_map<void *, BorrowRecord> borrow_map_;
 
 public:
   BorrowChecker() = default;
 
   void add_borrow(void *ptr, BorrowState state) {
-    assert(borrow_map_.count(ptr) == 0); // make sure the key doesn't already exist
-    borrow_map_[ptr] = state;
+    BorrowRecord &record = borrow_map_[ptr];
+    if (state == BorrowState::MutableBorrowed) {
+      assert((record.word & BorrowRecord::kMutable) ==
+             0); // make sure there is one mutable borrow
+      record.word |= BorrowRecord::kMutable;
+    } else {
+      assert(record.shared_count() !=
+             BorrowRecord::kShared); // make sure the count doesn't overflow
+      ++record.word;
+    }
+  }
+
+  // Takes a borrow unless it conflicts with the borrows already held on ptr:
+  // a mutable borrow needs an empty record, a shared one no mutable borrow.
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    BorrowRecord &record = borrow_map_[ptr];
+    std::uint32_t conflict =
+        state == BorrowState::MutableBorrowed ? ~0u : BorrowRecord::kMutable;
+    if (record.word & conflict) {
+      return false;
+    }
+    record.word += state == BorrowState::MutableBorrowed ? BorrowRecord::kMutable
+                                                         : 1;
+    return true;
   }
 
-  void remove_borrow(void *ptr) {
-    assert(borrow_map_.count(ptr) != 0); // make sure the key exists
-    borrow_map_.erase(ptr);
+  void remove_borrow(void *ptr, BorrowState state) {
+    auto it = borrow_map_.find(ptr);
+    assert(it != borrow_map_.end()); // make sure the key exists
+    if (state == BorrowState::MutableBorrowed) {
+      it->second.word &= ~BorrowRecord::kMutable;
+    } else {
+      assert(it->second.shared_count() != 0); // make sure a borrow is held
+      --it->second.word;
+    }
+    if (it->second.word == 0) {
+      borrow_map_.erase(it);
+    }
   }
 
   BorrowState check_borrow(void *ptr) {
@@ -30,7 +89,12 @@ public:
     if (it == borrow_map_.end()) {
       return BorrowState::Valid;
     }
-    return it->second;
+    return it->second.state();
+  }
+
+  std::uint32_t shared_count(void *ptr) {
+    auto it = borrow_map_.find(ptr);
+    return it == borrow_map_.end() ? 0 : it->second.shared_count();
   }
 };
 
@@ -44,74 +108,71 @@ public:
       : data_(data), borrow_checker_(borrow_checker) {
     assert(data_ != nullptr); // make sure data is not nullptr
     assert(borrow_checker_ != nullptr); // make sure borrow_checker is not nullptr
-    borrow_checker_->add_borrow(data_, BorrowState::Valid);
-  }
-
-  Ref(Ref<T> &&other) {
-    assert(data_ != nullptr); // make sure data is not nullptr
-    assert(borrow_checker_ != nullptr); // make sure borrow_checker is not nullptr
-    if (borrow_checker_->check_borrow(other.data_) != BorrowState::Valid) {
-      throw std::runtime_error("cannot move value while it is borrowed");
+    if (!borrow_checker_->try_add_borrow(data_, BorrowState::Valid)) {
+      borrow::borrow_error(
+          "cannot borrow as immutable because it is also borrowed as mutable");
     }
-    data_ = other.data_;
-    borrow_checker_ = other.borrow_checker_;
-    borrow_checker_->remove_borrow(other.data_);
-    borrow_checker_->add_borrow(data_, BorrowState::Valid);
   }
 
-  Ref<T> &operator=(Ref<T> &&other) {
-    assert(data_ != nullptr); // make sure data is not nullptr
-    assert(borrow_checker_ != nullptr); // make sure borrow_checker is not nullptr
-    if (this == &other) {
-      throw std::runtime_error("cannot move the same value twice");
-    }
-    if (borrow_checker_->check_borrow(other.data_) != BorrowState::Valid) {
-      throw std::runtime_error("cannot move value while it is borrowed");
+  // Moving hands the borrow over as it is: the record is untouched and the
+  // source is left empty.
+  Ref(Ref<T> &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        borrow_checker_(other.borrow_checker_) {}
+
+  Ref<T> &operator=(Ref<T> &&other) noexcept {
+    if (this != &other) {
+      release();
+      data_ = std::exchange(other.data_, nullptr);
+      borrow_checker_ = other.borrow_checker_;
     }
-    borrow_checker_->remove_borrow(data_);
-    data_ = other.data_;
-    borrow_checker_ = other.borrow_checker_;
-    borrow_checker_->remove_borrow(other.data_);
-    borrow_checker_->add_borrow(data_, BorrowState::Valid);
     return *this;
   }
 
   Ref(const Ref<T> &other)
       : data_(other.data_), borrow_checker_(other.borrow_checker_) {
-    assert(data_ != nullptr); // make sure data is not nullptr
     assert(borrow_checker_ != nullptr); // make sure borrow_checker is not nullptr
-    borrow_checker_->add_borrow(data_, BorrowState::Valid);
+    if (data_ != nullptr) {
+      borrow_checker_->add_borrow(data_, BorrowState::Valid);
+    }
   }
 
   Ref<T> &operator=(const Ref<T> &other) {
-    assert(data_ != nullptr); // make sure data is not nullptr
-    assert(borrow_checker_ != nullptr); // make sure borrow_checker is not nullptr
     if (this != &other) {
-      borrow_checker_->remove_borrow(data_);
+      release();
       data_ = other.data_;
       borrow_checker_ = other.borrow_checker_;
-      borrow_checker_->add_borrow(data_, BorrowState::Valid);
+      if (data_ != nullptr) {
+        borrow_checker_->add_borrow(data_, BorrowState::Valid);
+      }
     }
     return *this;
   }
 
-  ~Ref() { borrow_checker_->remove_borrow(data_); }
+  ~Ref() { release(); }
 
   T *operator->() {
     if (data_ == nullptr) {
-      throw std::runtime_error("Ref is empty");
+      borrow::borrow_error("Ref is empty");
     }
     return data_;
   }
 
   T &operator*() {
     if (data_ == nullptr) {
-      throw std::runtime_error("Ref is empty");
+      borrow::borrow_error("Ref is empty");
     }
     return *data_;
   }
 
   explicit operator bool() const { return data_ != nullptr; }
+
+private:
+  void release() {
+    if (data_ != nullptr) {
+      borrow_checker_->remove_borrow(data_, BorrowState::Valid);
+    }
+  }
 };
 
 template <typename T> class MutableRef {
@@ -122,24 +183,53 @@ private:
 public:
   MutableRef(T *data, BorrowChecker *borrow_checker)
       : data_(data), borrow_checker_(borrow_checker) {
-    if (borrow_checker_->check_borrow(data_) != BorrowState::Valid) {
-      throw std::runtime_error(
+    if (!borrow_checker_->try_add_borrow(data_, BorrowState::MutableBorrowed)) {
+      borrow::borrow_error(
           "cannot borrow as mutable more than once, already borrowed");
     }
-    borrow_checker_->add_borrow(data_, BorrowState::MutableBorrowed);
   }
 
   MutableRef(const MutableRef<T> &other) = delete;
 
   MutableRef<T> &operator=(const MutableRef<T> &other) = delete;
 
-  ~MutableRef() { borrow_checker_->remove_borrow(data_); }
+  MutableRef(MutableRef<T> &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        borrow_checker_(other.borrow_checker_) {}
+
+  MutableRef<T> &operator=(MutableRef<T> &&other) noexcept {
+    if (this != &other) {
+      release();
+      data_ = std::exchange(other.data_, nullptr);
+      borrow_checker_ = other.borrow_checker_;
+    }
+    return *this;
+  }
+
+  ~MutableRef() { release(); }
 
   T *operator->() { return data_; }
 
   T &operator*() { return *data_; }
+
+private:
+  void release() {
+    if (data_ != nullptr) {
+      borrow_checker_->remove_borrow(data_, BorrowState::MutableBorrowed);
+    }
+  }
 };
 
+// A copied Ref records a second borrow, so std::vector<Ref<T>> would copy on
+// reallocation, paying a checker update per element, unless the move is
+// noexcept.
+static_assert(std::is_nothrow_move_constructible<Ref<int>>::value &&
+                  std::is_nothrow_move_assignable<Ref<int>>::value,
+              "Ref moves must not throw");
+static_assert(std::is_nothrow_move_constructible<MutableRef<int>>::value &&
+                  std::is_nothrow_move_assignable<MutableRef<int>>::value,
+              "MutableRef moves must not throw");
+
 void start_v1() {
   BorrowChecker borrow_checker;
   std::vector<int> data = {1, 2, 3, 4, 5};
@@ -164,10 +254,14 @@ void start_v1() {
       std::cout << " " << item;
     }
     std::cout << std::endl;
+#if defined(__cpp_exceptions)
     try {
       MutableRef<std::vector<int>> data_mut_ref(&dat, &borrow_checker);
     } catch (const std::runtime_error &e) {
       std::cout << "Error: " << e.what() << std::endl;
     }
+#endif
   }
-}
\ No newline at end of file
+}
+
+} // namespace v1
@@ -1,84 +1,485 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <exception>
 #include <iostream>
 #include <memory>
-#include <unordered_map>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-enum class BorrowState { Valid, Invalid, MutableBorrowed, Owned };
+#include "borrow_error.h"
+#include "borrow_result.h"
+#include "borrow_stats.h"
+#include "borrow_trace.h"
+#include "ptr_map.h"
+
+namespace borrow {
+
+// Borrow state of one tracked address packed into a single word: the low 30
+// bits count shared borrows, the top two bits flag an exclusive borrow and
+// ownership. Any number of Refs to the same address share one record.
+struct BorrowRecord {
+  static constexpr std::uint32_t kMutable = 1u << 31;
+  static constexpr std::uint32_t kOwned = 1u << 30;
+  static constexpr std::uint32_t kShared = kOwned - 1;
+
+  std::uint32_t word = 0;
+
+  BorrowState state() const {
+    if (word & kMutable) {
+      return BorrowState::MutableBorrowed;
+    }
+    if (word & kOwned) {
+      return BorrowState::Owned;
+    }
+    return BorrowState::Valid;
+  }
+
+  std::uint32_t shared_count() const { return word & kShared; }
+
+  // Whether a new borrow of the given kind may be taken: shared borrows only
+  // conflict with an exclusive one, an exclusive borrow needs an empty word.
+  bool allows(BorrowState state) const {
+    if (state == BorrowState::MutableBorrowed) {
+      return word == 0;
+    }
+    return (word & kMutable) == 0;
+  }
+
+  void acquire(BorrowState state) {
+    switch (state) {
+    case BorrowState::Valid:
+      assert(shared_count() != kShared); // make sure the count doesn't overflow
+      ++word;
+      break;
+    case BorrowState::MutableBorrowed:
+      assert((word & kMutable) == 0); // make sure there is one mutable borrow
+      word |= kMutable;
+      break;
+    case BorrowState::Owned:
+      word |= kOwned;
+      break;
+    case BorrowState::Invalid:
+      break;
+    }
+  }
 
-class BorrowChecker {
+  void release(BorrowState state) {
+    switch (state) {
+    case BorrowState::Valid:
+      assert(shared_count() != 0); // make sure a shared borrow is held
+      --word;
+      break;
+    case BorrowState::MutableBorrowed:
+      word &= ~kMutable;
+      break;
+    case BorrowState::Owned:
+      word &= ~kOwned;
+      break;
+    case BorrowState::Invalid:
+      break;
+    }
+  }
+};
+
+// The borrow held on ptr, looked up only once a borrow has been refused.
+template <typename Checker, typename T>
+BorrowState held_borrow(Checker *checker, T *ptr) {
+  if constexpr (requires { checker->check_region(ptr, sizeof(T)); }) {
+    return checker->check_region(ptr, sizeof(T));
+  } else if constexpr (requires { checker->check_borrow(ptr); }) {
+    return checker->check_borrow(ptr);
+  } else {
+    return BorrowState::Invalid;
+  }
+}
+
+// Storage policies for BasicBorrowChecker: each names the map type that holds
+// the per-address borrow state.
+struct NodeStorage {
+  template <typename V> using map_type = UnorderedPtrMap<V>;
+};
+
+struct FlatStorage {
+  template <typename V> using map_type = FlatPtrMap<V>;
+};
+
+struct PmrStorage {
+  template <typename V> using map_type = PmrPtrMap<V>;
+};
+
+// Room for at most N tracked addresses, held inside the checker.
+template <std::size_t N> struct FixedStorage {
+  template <typename V> using map_type = FixedPtrMap<V, N>;
+};
+
+template <typename T, typename Checker> class RefSet;
+
+template <typename Storage = NodeStorage> class BasicBorrowChecker {
 private:
-  std::unordered_map<void *, BorrowState> borrow_map_;
+  typename Storage::template map_type<BorrowRecord> borrow_map_;
+  [[no_unique_address]] BorrowStatsCounters stats_;
+
+  BorrowRecord *lookup(void *ptr) {
+    if constexpr (BorrowStatsCounters::enabled) {
+      stats_.on_probe(borrow_map_.probe_length(ptr));
+    }
+    return borrow_map_.find(ptr);
+  }
+
+  BorrowRecord &lookup_or_insert(void *ptr) {
+    if (BorrowRecord *record = lookup(ptr)) {
+      return *record;
+    }
+    BorrowRecord &record = borrow_map_.insert(ptr, BorrowRecord{});
+    stats_.on_live(borrow_map_.size());
+    return record;
+  }
 
 public:
-  BorrowChecker() = default;
+  BasicBorrowChecker() = default;
+
+  // Only for PmrStorage: map nodes are allocated from resource, which must
+  // outlive the checker.
+  explicit BasicBorrowChecker(std::pmr::memory_resource *resource)
+      : borrow_map_(resource) {}
 
   void add_borrow(void *ptr, BorrowState state) {
-    assert(borrow_map_.count(ptr) ==
-           0); // make sure the key doesn't already exist
-    borrow_map_[ptr] = state;
+    stats_.on_add();
+    BorrowTrace::on_add(ptr, static_cast<std::uint8_t>(state),
+                        BORROW_TRACE_CALLER());
+    lookup_or_insert(ptr).acquire(state);
   }
 
-  void remove_borrow(void *ptr) {
-    auto it = borrow_map_.find(ptr);
-    if (it == borrow_map_.end()) {
-      // The key is not present in the map
+  // Takes a borrow of the given kind unless it conflicts with the borrows
+  // already held on ptr; returns false on conflict.
+  bool try_add_borrow(void *ptr, BorrowState state) {
+    BorrowRecord &record = lookup_or_insert(ptr);
+    if (!record.allows(state)) {
+      stats_.on_conflict(static_cast<std::size_t>(record.state()));
+      BorrowTrace::on_conflict(ptr, static_cast<std::uint8_t>(state),
+                               static_cast<std::uint8_t>(record.state()),
+                               BORROW_TRACE_CALLER());
+      return false;
+    }
+    stats_.on_add();
+    BorrowTrace::on_add(ptr, static_cast<std::uint8_t>(state),
+                        BORROW_TRACE_CALLER());
+    record.acquire(state);
+    return true;
+  }
+
+  // Takes a borrow of the given kind on every address, or on none of them if
+  // any conflicts with a borrow already held. The table is grown once for the
+  // addresses it doesn't track yet. Repeated addresses are only allowed for
+  // shared borrows; an exclusive batch naming one twice conflicts with itself.
+  template <typename T>
+  bool try_add_borrows(std::span<T *const> ptrs, BorrowState state) {
+    if (state != BorrowState::Valid && ptrs.size() > 1) {
+      std::vector<T *> sorted(ptrs.begin(), ptrs.end());
+      std::sort(sorted.begin(), sorted.end());
+      auto repeat = std::adjacent_find(sorted.begin(), sorted.end());
+      if (repeat != sorted.end()) {
+        stats_.on_conflict(static_cast<std::size_t>(state));
+        BorrowTrace::on_conflict(*repeat, static_cast<std::uint8_t>(state),
+                                 static_cast<std::uint8_t>(state),
+                                 BORROW_TRACE_CALLER());
+        return false;
+      }
+    }
+    std::vector<T *> untracked;
+    for (T *ptr : ptrs) {
+      BorrowRecord *record = lookup(ptr);
+      if (record == nullptr) {
+        untracked.push_back(ptr);
+      } else if (!record->allows(state)) {
+        stats_.on_conflict(static_cast<std::size_t>(record->state()));
+        BorrowTrace::on_conflict(ptr, static_cast<std::uint8_t>(state),
+                                 static_cast<std::uint8_t>(record->state()),
+                                 BORROW_TRACE_CALLER());
+        return false;
+      }
+    }
+    // Only addresses not yet tracked need room, each counted once, so a full
+    // fixed-size table fails here before anything is borrowed.
+    std::sort(untracked.begin(), untracked.end());
+    std::size_t new_keys = static_cast<std::size_t>(
+        std::unique(untracked.begin(), untracked.end()) - untracked.begin());
+    borrow_map_.reserve(borrow_map_.size() + new_keys);
+    for (T *ptr : ptrs) {
+      add_borrow(ptr, state);
+    }
+    return true;
+  }
+
+  template <typename T>
+  void remove_borrows(std::span<T *const> ptrs, BorrowState state) {
+    for (T *ptr : ptrs) {
+      remove_borrow(ptr, state);
+    }
+  }
+
+  // Shared borrows of every address in ptrs, held until the RefSet is
+  // destroyed. Throws without borrowing anything if one of them is mutably
+  // borrowed.
+  template <typename T>
+  RefSet<T, BasicBorrowChecker> borrow_all(std::span<T *const> ptrs) {
+    if (!try_add_borrows(ptrs, BorrowState::Valid)) {
+      fail_borrow(
+          {BorrowErrc::SharedWhileMutable, BorrowState::MutableBorrowed});
+    }
+    return RefSet<T, BasicBorrowChecker>(
+        std::vector<T *>(ptrs.begin(), ptrs.end()), this);
+  }
+
+  template <typename T>
+  RefSet<T, BasicBorrowChecker> borrow_all(const std::vector<T *> &ptrs) {
+    return borrow_all(std::span<T *const>(ptrs));
+  }
+
+  // Releases one borrow of the given kind, dropping the record once the
+  // address has no borrows left.
+  void remove_borrow(void *ptr, BorrowState state) {
+    stats_.on_remove();
+    BorrowTrace::on_remove(ptr, static_cast<std::uint8_t>(state),
+                           BORROW_TRACE_CALLER());
+    BorrowRecord *record = lookup(ptr);
+    if (record == nullptr) {
       return;
     }
-    borrow_map_.erase(it);
+    record->release(state);
+    if (record->word == 0) {
+      borrow_map_.erase(ptr);
+    }
+  }
+
+  // Drops every borrow recorded for ptr.
+  void remove_borrow(void *ptr) {
+    stats_.on_remove();
+    BorrowTrace::on_remove_all(ptr, BORROW_TRACE_CALLER());
+    borrow_map_.erase(ptr);
   }
 
   BorrowState check_borrow(void *ptr) {
-    auto it = borrow_map_.find(ptr);
-    if (it == borrow_map_.end()) {
+    stats_.on_check();
+    BorrowRecord *record = lookup(ptr);
+    if (record == nullptr) {
       return BorrowState::Valid;
     }
-    return it->second;
+    return record->state();
+  }
+
+  std::uint32_t shared_count(void *ptr) {
+    BorrowRecord *record = lookup(ptr);
+    return record == nullptr ? 0 : record->shared_count();
+  }
+
+  // The record held for ptr; an empty record if ptr is untracked.
+  BorrowRecord record(void *ptr) {
+    BorrowRecord *record = lookup(ptr);
+    return record == nullptr ? BorrowRecord{} : *record;
   }
 
   void set_owned(void *ptr) {
-    auto it = borrow_map_.find(ptr);
-    if (it != borrow_map_.end()) {
-      it->second = BorrowState::Owned;
+    BorrowRecord *record = lookup(ptr);
+    if (record != nullptr) {
+      record->acquire(BorrowState::Owned);
     }
   }
 
   bool check_owned(void *ptr) {
-    auto it = borrow_map_.find(ptr);
-    if (it == borrow_map_.end()) {
+    BorrowRecord *record = lookup(ptr);
+    if (record == nullptr) {
       return false;
     }
-    return it->second == BorrowState::Owned;
+    return (record->word & BorrowRecord::kOwned) != 0;
+  }
+
+  // Counters gathered when built with BORROW_CHECKER_STATS; an all-zero
+  // snapshot with enabled == false otherwise.
+  BorrowStats stats() const { return stats_.snapshot(); }
+};
+
+using BorrowChecker = BasicBorrowChecker<>;
+using FlatBorrowChecker = BasicBorrowChecker<FlatStorage>;
+using PmrBorrowChecker = BasicBorrowChecker<PmrStorage>;
+
+// A batch of shared borrows taken together by BorrowChecker::borrow_all and
+// released together when the set is destroyed.
+template <typename T, typename Checker = BorrowChecker> class RefSet {
+private:
+  std::vector<T *> data_;
+  Checker *borrow_checker_;
+
+  template <typename Storage> friend class BasicBorrowChecker;
+
+  // Adopts borrows the checker has already taken.
+  RefSet(std::vector<T *> data, Checker *borrow_checker)
+      : data_(std::move(data)), borrow_checker_(borrow_checker) {}
+
+public:
+  RefSet(const RefSet &) = delete;
+  RefSet &operator=(const RefSet &) = delete;
+
+  RefSet(RefSet &&other) noexcept
+      : data_(std::move(other.data_)), borrow_checker_(other.borrow_checker_) {
+    other.data_.clear();
+  }
+
+  RefSet &operator=(RefSet &&other) noexcept {
+    if (this != &other) {
+      release();
+      data_ = std::move(other.data_);
+      other.data_.clear();
+      borrow_checker_ = other.borrow_checker_;
+    }
+    return *this;
+  }
+
+  ~RefSet() { release(); }
+
+  std::size_t size() const { return data_.size(); }
+
+  bool empty() const { return data_.empty(); }
+
+  T &operator[](std::size_t i) const { return *data_[i]; }
+
+private:
+  void release() {
+    if (!data_.empty()) {
+      borrow_checker_->remove_borrows(std::span<T *const>(data_),
+                                      BorrowState::Valid);
+      data_.clear();
+    }
+  }
+};
+
+// How much runtime checking the wrappers do. Full tracks every borrow in the
+// checker; None compiles them down to a bare pointer with no checker member
+// and no side effects; DebugOnly is Full unless NDEBUG is defined.
+namespace CheckPolicy {
+struct Full {};
+struct None {};
+#ifdef NDEBUG
+using DebugOnly = None;
+#else
+using DebugOnly = Full;
+#endif
+} // namespace CheckPolicy
+
+template <typename T, typename Checker, typename Policy, typename Deleter>
+class Sendable;
+
+template <typename T, typename Checker, typename Policy> class Weak;
+
+// What a Ref or MutableRef keeps to release its borrow. Most checkers find the
+// record again by address, so the token is empty; checkers that declare a
+// handle_type hand one out when the borrow is taken and release through it.
+// Checkers that track byte ranges, such as RegionBorrowChecker, are given
+// the whole sizeof(T) bytes of the value, so a borrow of an object and a
+// borrow of one of its members see each other.
+template <typename Checker> struct BorrowToken {
+  struct type {};
+
+  template <typename T>
+  static bool try_acquire(Checker *checker, T *ptr, BorrowState state,
+                          type &) {
+    if constexpr (requires {
+                    checker->try_add_region(ptr, sizeof(T), state);
+                  }) {
+      return checker->try_add_region(ptr, sizeof(T), state);
+    } else {
+      return checker->try_add_borrow(ptr, state);
+    }
+  }
+
+  template <typename T>
+  static void release(Checker *checker, T *ptr, BorrowState state, type) {
+    if constexpr (requires { checker->remove_region(ptr, sizeof(T), state); }) {
+      checker->remove_region(ptr, sizeof(T), state);
+    } else {
+      checker->remove_borrow(ptr, state);
+    }
+  }
+};
+
+template <typename Checker>
+  requires requires { typename Checker::handle_type; }
+struct BorrowToken<Checker> {
+  using type = typename Checker::handle_type;
+
+  template <typename T>
+  static bool try_acquire(Checker *checker, T *ptr, BorrowState state,
+                          type &handle) {
+    return checker->try_add_borrow(ptr, state, handle);
+  }
+
+  template <typename T>
+  static void release(Checker *checker, T *, BorrowState state, type handle) {
+    checker->remove_borrow(handle, state);
   }
 };
 
-template <typename T> class Own {
+// Frees a value obtained from an allocator, e.g. a
+// std::pmr::polymorphic_allocator over a pool; see allocate_own.
+template <typename Alloc> struct AllocatorDeleter {
+  [[no_unique_address]] Alloc alloc;
+
+  void operator()(typename std::allocator_traits<Alloc>::value_type *ptr) {
+    std::allocator_traits<Alloc>::destroy(alloc, ptr);
+    std::allocator_traits<Alloc>::deallocate(alloc, ptr, 1);
+  }
+};
+
+// Owning pointer to a tracked value. The value is released with Deleter,
+// which defaults to delete.
+template <typename T, typename Checker = BorrowChecker,
+          typename Policy = CheckPolicy::Full,
+          typename Deleter = std::default_delete<T>>
+class Own {
 private:
   T *data_;
-  BorrowChecker *borrow_checker_;
+  Checker *borrow_checker_;
   bool is_owner_;
+  [[no_unique_address]] Deleter deleter_;
 
 public:
-  explicit Own(T *data, BorrowChecker *borrow_checker)
-      : data_(data), borrow_checker_(borrow_checker), is_owner_(true) {}
+  explicit Own(T *data, Checker *borrow_checker, Deleter deleter = Deleter())
+      : data_(data), borrow_checker_(borrow_checker), is_owner_(true),
+        deleter_(std::move(deleter)) {}
 
   Own(const Own &) = delete;
   Own &operator=(const Own &) = delete;
 
   Own(Own &&other) noexcept
       : data_(std::exchange(other.data_, nullptr)),
-        borrow_checker_(other.borrow_checker_), is_owner_(other.is_owner_) {
+        borrow_checker_(other.borrow_checker_), is_owner_(other.is_owner_),
+        deleter_(std::move(other.deleter_)) {
     other.is_owner_ = false;
   }
 
   Own &operator=(Own &&other) noexcept {
     if (this != &other) {
-      borrow_checker_->remove_borrow(data_);
+      if (is_owner_) {
+        borrow_checker_->remove_borrow(data_);
+        if (data_ != nullptr) {
+          deleter_(data_);
+        }
+      }
       data_ = std::exchange(other.data_, nullptr);
       borrow_checker_ = other.borrow_checker_;
       is_owner_ = other.is_owner_;
+      deleter_ = std::move(other.deleter_);
       other.is_owner_ = false;
     }
     return *this;
@@ -89,7 +490,9 @@ public:
   ~Own() {
     if (is_owner_) {
       borrow_checker_->remove_borrow(data_);
-      delete data_;
+      if (data_ != nullptr) {
+        deleter_(data_);
+      }
     }
   }
 
@@ -99,26 +502,268 @@ public:
 
   void set_owner() {
     if (!is_owner_) {
-      throw std::runtime_error("value already has an owner");
+      borrow_error("value already has an owner");
     }
     borrow_checker_->set_owned(data_);
   }
 
   bool is_owned() const { return borrow_checker_->check_owned(data_); }
+
+  // Hands the value to another thread, which takes it back with
+  // Sendable::receive(); this Own is left empty, as if moved from. Needs a
+  // checker that tracks values per thread, such as ShardedBorrowChecker, and
+  // throws if the value is still borrowed.
+  Sendable<T, Checker, Policy, Deleter> send_to_thread() {
+    if (!is_owner_) {
+      borrow_error("cannot send a value that has been moved");
+    }
+    borrow_checker_->send(data_);
+    is_owner_ = false;
+    return Sendable<T, Checker, Policy, Deleter>(
+        std::exchange(data_, nullptr), borrow_checker_, std::move(deleter_));
+  }
+
+  // A non-owning observer that can tell when this value has been freed.
+  // Needs a checker that pins records, such as SlotBorrowChecker.
+  Weak<T, Checker, Policy> downgrade() const {
+    return Weak<T, Checker, Policy>(data_, borrow_checker_);
+  }
+};
+
+// An Own on its way to another thread, produced by Own::send_to_thread().
+// Dropping it without receive() frees the value like the Own would have.
+template <typename T, typename Checker, typename Policy, typename Deleter>
+class Sendable {
+private:
+  T *data_;
+  Checker *borrow_checker_;
+  [[no_unique_address]] Deleter deleter_;
+
+  friend class Own<T, Checker, Policy, Deleter>;
+
+  Sendable(T *data, Checker *borrow_checker, Deleter deleter)
+      : data_(data), borrow_checker_(borrow_checker),
+        deleter_(std::move(deleter)) {}
+
+public:
+  Sendable(const Sendable &) = delete;
+  Sendable &operator=(const Sendable &) = delete;
+
+  Sendable(Sendable &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        borrow_checker_(other.borrow_checker_),
+        deleter_(std::move(other.deleter_)) {}
+
+  ~Sendable() {
+    if (data_ != nullptr) {
+      borrow_checker_->drop_sent(data_);
+      deleter_(data_);
+    }
+  }
+
+  // Adopts the value on the calling thread.
+  Own<T, Checker, Policy, Deleter> receive() {
+    borrow_checker_->receive(data_);
+    return Own<T, Checker, Policy, Deleter>(
+        std::exchange(data_, nullptr), borrow_checker_, std::move(deleter_));
+  }
+};
+
+// Non-owning observer of a value, from Own::downgrade(). It holds the
+// generation-tagged handle of the value's pinned record, so upgrade() is
+// one compare against the record's generation, with no lookup: once the
+// owner drops the value the generation moves on and upgrade() returns
+// nullptr instead of a dangling pointer. Weak is copyable and may outlive
+// the value, but not its checker.
+template <typename T, typename Checker, typename Policy = CheckPolicy::Full>
+class Weak {
+private:
+  T *data_ = nullptr;
+  Checker *borrow_checker_ = nullptr;
+  typename Checker::handle_type handle_{};
+
+public:
+  Weak() = default;
+
+  Weak(T *data, Checker *borrow_checker)
+      : data_(data), borrow_checker_(borrow_checker) {
+    if (data_ != nullptr) {
+      handle_ = borrow_checker_->pin(data_);
+    }
+  }
+
+  // The value, or nullptr if it has been freed.
+  T *upgrade() const {
+    if (data_ == nullptr || !borrow_checker_->is_pinned(handle_)) {
+      return nullptr;
+    }
+    return data_;
+  }
+
+  bool expired() const { return upgrade() == nullptr; }
+};
+
+// Own that keeps the value inside itself rather than on the heap. Borrows
+// are keyed by address, so moving an InlineOwn moves the value to a new
+// address and carries its ownership over; the move throws if the value is
+// still borrowed.
+template <typename T, typename Checker = BorrowChecker,
+          typename Policy = CheckPolicy::Full>
+class InlineOwn {
+private:
+  T value_;
+  Checker *borrow_checker_;
+  bool is_owner_;
+
+  // The value, once it is known that nothing borrows it.
+  T &&take() {
+    if (borrow_checker_->check_borrow(&value_) ==
+            BorrowState::MutableBorrowed ||
+        borrow_checker_->shared_count(&value_) != 0) {
+      borrow_error("cannot move value while it is borrowed");
+    }
+    return std::move(value_);
+  }
+
+  // Moves other's ownership record to this value's address.
+  void adopt(InlineOwn &other) {
+    bool owned = other.borrow_checker_->check_owned(&other.value_);
+    other.borrow_checker_->remove_borrow(&other.value_);
+    other.is_owner_ = false;
+    if (owned) {
+      borrow_checker_->add_borrow(&value_, BorrowState::Owned);
+    }
+  }
+
+public:
+  template <typename... Args>
+  explicit InlineOwn(std::in_place_t, Checker *borrow_checker,
+                     Args &&...args)
+      : value_(std::forward<Args>(args)...), borrow_checker_(borrow_checker),
+        is_owner_(true) {}
+
+  InlineOwn(const InlineOwn &) = delete;
+  InlineOwn &operator=(const InlineOwn &) = delete;
+
+  InlineOwn(InlineOwn &&other)
+      : value_(other.take()), borrow_checker_(other.borrow_checker_),
+        is_owner_(other.is_owner_) {
+    adopt(other);
+  }
+
+  InlineOwn &operator=(InlineOwn &&other) {
+    if (this != &other) {
+      take();
+      value_ = other.take();
+      borrow_checker_->remove_borrow(&value_);
+      borrow_checker_ = other.borrow_checker_;
+      is_owner_ = other.is_owner_;
+      adopt(other);
+    }
+    return *this;
+  }
+
+  ~InlineOwn() {
+    if (is_owner_) {
+      borrow_checker_->remove_borrow(&value_);
+    }
+  }
+
+  T *get() { return &value_; }
+
+  T *operator->() { return &value_; }
+
+  T &operator*() { return value_; }
+
+  void set_owner() {
+    if (!is_owner_) {
+      borrow_error("value already has an owner");
+    }
+    borrow_checker_->set_owned(&value_);
+  }
+
+  bool is_owned() const {
+    return borrow_checker_->check_owned(const_cast<T *>(&value_));
+  }
 };
 
-template <typename T> class Ref {
+// Builds an InlineOwn<T> with T constructed from args directly in the result:
+// no allocation and no copy or move of the value.
+template <typename T, typename Policy = CheckPolicy::Full, typename Checker,
+          typename... Args>
+InlineOwn<T, Checker, Policy> make_own(Checker *borrow_checker,
+                                       Args &&...args) {
+  return InlineOwn<T, Checker, Policy>(std::in_place, borrow_checker,
+                                       std::forward<Args>(args)...);
+}
+
+// Builds an Own<T> whose value comes from alloc and is returned to it when
+// the Own is destroyed, e.g. with a std::pmr::polymorphic_allocator<T> over
+// a pool resource.
+template <typename T, typename Policy = CheckPolicy::Full, typename Checker,
+          typename Alloc, typename... Args>
+Own<T, Checker, Policy, AllocatorDeleter<Alloc>>
+allocate_own(const Alloc &alloc, Checker *borrow_checker, Args &&...args) {
+  static_assert(std::is_same_v<typename Alloc::value_type, T>,
+                "allocator must allocate T");
+  AllocatorDeleter<Alloc> deleter{alloc};
+  T *data = std::allocator_traits<Alloc>::allocate(deleter.alloc, 1);
+#if defined(__cpp_exceptions)
+  try {
+    std::allocator_traits<Alloc>::construct(deleter.alloc, data,
+                                            std::forward<Args>(args)...);
+  } catch (...) {
+    std::allocator_traits<Alloc>::deallocate(deleter.alloc, data, 1);
+    throw;
+  }
+#else
+  std::allocator_traits<Alloc>::construct(deleter.alloc, data,
+                                          std::forward<Args>(args)...);
+#endif
+  return Own<T, Checker, Policy, AllocatorDeleter<Alloc>>(
+      data, borrow_checker, std::move(deleter));
+}
+
+template <typename T, typename Checker = BorrowChecker,
+          typename Policy = CheckPolicy::Full>
+class Ref {
 private:
+  using Token = BorrowToken<Checker>;
+
+  struct Adopt {};
+
   T *data_;
-  BorrowChecker *borrow_checker_;
+  Checker *borrow_checker_;
+  [[no_unique_address]] typename Token::type token_;
+
+  Ref(T *data, Checker *borrow_checker, typename Token::type token, Adopt)
+      : data_(data), borrow_checker_(borrow_checker), token_(token) {}
+
+  static BorrowConflict conflict() {
+    return {BorrowErrc::SharedWhileMutable, BorrowState::MutableBorrowed};
+  }
 
 public:
-  Ref(T *data, BorrowChecker *borrow_checker)
+  Ref(T *data, Checker *borrow_checker)
       : data_(data), borrow_checker_(borrow_checker) {
     assert(data_ != nullptr); // make sure data is not nullptr
     assert(borrow_checker_ !=
            nullptr); // make sure borrow_checker is not nullptr
-    borrow_checker_->add_borrow(data_, BorrowState::Valid);
+    if (!Token::try_acquire(borrow_checker_, data_, BorrowState::Valid,
+                            token_)) {
+      fail_borrow(conflict());
+    }
+  }
+
+  // Takes a shared borrow of data, or returns the conflict without going
+  // through the failure handler.
+  static BorrowResult<Ref> try_borrow(T *data, Checker *borrow_checker) {
+    assert(data != nullptr); // make sure data is not nullptr
+    typename Token::type token{};
+    if (!Token::try_acquire(borrow_checker, data, BorrowState::Valid, token)) {
+      return conflict();
+    }
+    return Ref(data, borrow_checker, token, Adopt{});
   }
 
   Ref(const Ref &) = delete;
@@ -126,24 +771,25 @@ public:
 
   Ref(Ref &&other) noexcept
       : data_(std::exchange(other.data_, nullptr)),
-        borrow_checker_(other.borrow_checker_) {}
+        borrow_checker_(other.borrow_checker_), token_(other.token_) {}
 
+  // Releases this Ref's own borrow, then takes over other's pointer and
+  // token; other's record is untouched and other is left empty.
   Ref &operator=(Ref &&other) noexcept {
     if (this != &other) {
-      if (borrow_checker_->check_borrow(other.data_) != BorrowState::Valid) {
-        throw std::runtime_error("cannot move value while it is borrowed");
+      if (data_ != nullptr) {
+        Token::release(borrow_checker_, data_, BorrowState::Valid, token_);
       }
-      borrow_checker_->remove_borrow(data_);
       data_ = std::exchange(other.data_, nullptr);
       borrow_checker_ = other.borrow_checker_;
-      borrow_checker_->add_borrow(data_, BorrowState::Valid);
+      token_ = other.token_;
     }
     return *this;
   }
 
   ~Ref() {
     if (data_ != nullptr) {
-      borrow_checker_->remove_borrow(data_);
+      Token::release(borrow_checker_, data_, BorrowState::Valid, token_);
     }
   }
 
@@ -152,32 +798,314 @@ public:
   T &operator*() const { return *data_; }
 };
 
-template <typename T> class MutableRef {
+template <typename T, typename Checker = BorrowChecker,
+          typename Policy = CheckPolicy::Full>
+class MutableRef {
 private:
+  using Token = BorrowToken<Checker>;
+
+  struct Adopt {};
+
   T *data_;
-  BorrowChecker *borrow_checker_;
+  Checker *borrow_checker_;
+  [[no_unique_address]] typename Token::type token_;
+
+  MutableRef(T *data, Checker *borrow_checker, typename Token::type token,
+             Adopt)
+      : data_(data), borrow_checker_(borrow_checker), token_(token) {}
+
+  static BorrowConflict conflict(Checker *borrow_checker, T *data) {
+    return {BorrowErrc::MutableWhileBorrowed,
+            held_borrow(borrow_checker, data)};
+  }
 
 public:
-  MutableRef(T *data, BorrowChecker *borrow_checker)
+  MutableRef(T *data, Checker *borrow_checker)
       : data_(data), borrow_checker_(borrow_checker) {
-    if (borrow_checker_->check_borrow(data_) != BorrowState::Valid) {
-      throw std::runtime_error(
-          "cannot borrow as mutable more than once, already borrowed");
+    if (!Token::try_acquire(borrow_checker_, data_,
+                            BorrowState::MutableBorrowed, token_)) {
+      fail_borrow(conflict(borrow_checker_, data_));
+    }
+  }
+
+  // Takes an exclusive borrow of data, or returns the conflict without going
+  // through the failure handler.
+  static BorrowResult<MutableRef> try_borrow_mut(T *data,
+                                                 Checker *borrow_checker) {
+    typename Token::type token{};
+    if (!Token::try_acquire(borrow_checker, data, BorrowState::MutableBorrowed,
+                            token)) {
+      return conflict(borrow_checker, data);
+    }
+    return MutableRef(data, borrow_checker, token, Adopt{});
+  }
+
+  MutableRef(const MutableRef &other) = delete;
+
+  MutableRef &operator=(const MutableRef &other) = delete;
+
+  MutableRef(MutableRef &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        borrow_checker_(other.borrow_checker_), token_(other.token_) {}
+
+  MutableRef &operator=(MutableRef &&other) noexcept {
+    if (this != &other) {
+      if (data_ != nullptr) {
+        Token::release(borrow_checker_, data_, BorrowState::MutableBorrowed,
+                       token_);
+      }
+      data_ = std::exchange(other.data_, nullptr);
+      borrow_checker_ = other.borrow_checker_;
+      token_ = other.token_;
+    }
+    return *this;
+  }
+
+  ~MutableRef() {
+    if (data_ != nullptr) {
+      Token::release(borrow_checker_, data_, BorrowState::MutableBorrowed,
+                     token_);
+    }
+  }
+
+  T *operator->() { return data_; }
+
+  T &operator*() { return *data_; }
+};
+
+// Unchecked wrappers: same interface, nothing recorded.
+template <typename T, typename Checker, typename Deleter>
+class Own<T, Checker, CheckPolicy::None, Deleter> {
+private:
+  T *data_;
+  [[no_unique_address]] Deleter deleter_;
+
+public:
+  explicit Own(T *data, Checker *, Deleter deleter = Deleter())
+      : data_(data), deleter_(std::move(deleter)) {}
+
+  Own(const Own &) = delete;
+  Own &operator=(const Own &) = delete;
+
+  Own(Own &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        deleter_(std::move(other.deleter_)) {}
+
+  Own &operator=(Own &&other) noexcept {
+    if (this != &other) {
+      if (data_ != nullptr) {
+        deleter_(data_);
+      }
+      data_ = std::exchange(other.data_, nullptr);
+      deleter_ = std::move(other.deleter_);
+    }
+    return *this;
+  }
+
+  T *get() const { return data_; }
+
+  ~Own() {
+    if (data_ != nullptr) {
+      deleter_(data_);
     }
-    borrow_checker_->add_borrow(data_, BorrowState::MutableBorrowed);
   }
 
-  MutableRef(const MutableRef<T> &other) = delete;
+  T *operator->() const { return data_; }
+
+  T &operator*() const { return *data_; }
+
+  void set_owner() {}
+
+  bool is_owned() const { return false; }
+
+  Sendable<T, Checker, CheckPolicy::None, Deleter> send_to_thread() {
+    return Sendable<T, Checker, CheckPolicy::None, Deleter>(
+        std::exchange(data_, nullptr), std::move(deleter_));
+  }
+
+  Weak<T, Checker, CheckPolicy::None> downgrade() const {
+    return Weak<T, Checker, CheckPolicy::None>(data_, nullptr);
+  }
+};
+
+template <typename T, typename Checker, typename Deleter>
+class Sendable<T, Checker, CheckPolicy::None, Deleter> {
+private:
+  T *data_;
+  [[no_unique_address]] Deleter deleter_;
+
+  friend class Own<T, Checker, CheckPolicy::None, Deleter>;
+
+  Sendable(T *data, Deleter deleter)
+      : data_(data), deleter_(std::move(deleter)) {}
+
+public:
+  Sendable(const Sendable &) = delete;
+  Sendable &operator=(const Sendable &) = delete;
+
+  Sendable(Sendable &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)),
+        deleter_(std::move(other.deleter_)) {}
+
+  ~Sendable() {
+    if (data_ != nullptr) {
+      deleter_(data_);
+    }
+  }
+
+  Own<T, Checker, CheckPolicy::None, Deleter> receive() {
+    return Own<T, Checker, CheckPolicy::None, Deleter>(
+        std::exchange(data_, nullptr), nullptr, std::move(deleter_));
+  }
+};
+
+// Unchecked observers can't tell that the value is gone.
+template <typename T, typename Checker>
+class Weak<T, Checker, CheckPolicy::None> {
+private:
+  T *data_ = nullptr;
+
+public:
+  Weak() = default;
+
+  Weak(T *data, Checker *) : data_(data) {}
+
+  T *upgrade() const { return data_; }
+
+  bool expired() const { return data_ == nullptr; }
+};
+
+template <typename T, typename Checker>
+class InlineOwn<T, Checker, CheckPolicy::None> {
+private:
+  T value_;
+
+public:
+  template <typename... Args>
+  explicit InlineOwn(std::in_place_t, Checker *, Args &&...args)
+      : value_(std::forward<Args>(args)...) {}
+
+  InlineOwn(const InlineOwn &) = delete;
+  InlineOwn &operator=(const InlineOwn &) = delete;
+
+  InlineOwn(InlineOwn &&other) = default;
+  InlineOwn &operator=(InlineOwn &&other) = default;
+
+  T *get() { return &value_; }
+
+  T *operator->() { return &value_; }
 
-  MutableRef<T> &operator=(const MutableRef<T> &other) = delete;
+  T &operator*() { return value_; }
 
-  ~MutableRef() { borrow_checker_->remove_borrow(data_); }
+  void set_owner() {}
+
+  bool is_owned() const { return false; }
+};
+
+template <typename T, typename Checker> class Ref<T, Checker, CheckPolicy::None> {
+private:
+  T *data_;
+
+public:
+  Ref(T *data, Checker *) : data_(data) {}
+
+  static BorrowResult<Ref> try_borrow(T *data, Checker *borrow_checker) {
+    return Ref(data, borrow_checker);
+  }
+
+  Ref(const Ref &) = delete;
+  Ref &operator=(const Ref &) = delete;
+
+  Ref(Ref &&other) noexcept : data_(std::exchange(other.data_, nullptr)) {}
+
+  Ref &operator=(Ref &&other) noexcept {
+    data_ = std::exchange(other.data_, nullptr);
+    return *this;
+  }
+
+  T *operator->() const { return data_; }
+
+  T &operator*() const { return *data_; }
+};
+
+template <typename T, typename Checker>
+class MutableRef<T, Checker, CheckPolicy::None> {
+private:
+  T *data_;
+
+public:
+  MutableRef(T *data, Checker *) : data_(data) {}
+
+  static BorrowResult<MutableRef> try_borrow_mut(T *data,
+                                                 Checker *borrow_checker) {
+    return MutableRef(data, borrow_checker);
+  }
+
+  MutableRef(const MutableRef &other) = delete;
+
+  MutableRef &operator=(const MutableRef &other) = delete;
+
+  MutableRef(MutableRef &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)) {}
+
+  MutableRef &operator=(MutableRef &&other) noexcept {
+    data_ = std::exchange(other.data_, nullptr);
+    return *this;
+  }
 
   T *operator->() { return data_; }
 
   T &operator*() { return *data_; }
 };
 
+static_assert(sizeof(Ref<int, BorrowChecker, CheckPolicy::None>) ==
+                  sizeof(int *),
+              "unchecked Ref must be a bare pointer");
+static_assert(sizeof(MutableRef<int, BorrowChecker, CheckPolicy::None>) ==
+                  sizeof(int *),
+              "unchecked MutableRef must be a bare pointer");
+static_assert(sizeof(Own<int, BorrowChecker, CheckPolicy::None>) ==
+                  sizeof(int *),
+              "unchecked Own must be a bare pointer");
+static_assert(sizeof(InlineOwn<int, BorrowChecker, CheckPolicy::None>) ==
+                  sizeof(int),
+              "unchecked InlineOwn must be the bare value");
+static_assert(sizeof(Ref<int>) == 2 * sizeof(void *),
+              "address-keyed borrows carry no token");
+static_assert(sizeof(BorrowResult<Ref<int>>) == 3 * sizeof(void *),
+              "a borrow result is the borrow plus a flag");
+
+// Shared and exclusive borrows that report a conflict instead of throwing,
+// e.g. try_borrow(&value, &checker) or try_borrow_mut<CheckPolicy::None>(...).
+template <typename Policy = CheckPolicy::Full, typename T, typename Checker>
+BorrowResult<Ref<T, Checker, Policy>> try_borrow(T *data,
+                                                 Checker *borrow_checker) {
+  return Ref<T, Checker, Policy>::try_borrow(data, borrow_checker);
+}
+
+template <typename Policy = CheckPolicy::Full, typename T, typename Checker>
+BorrowResult<MutableRef<T, Checker, Policy>>
+try_borrow_mut(T *data, Checker *borrow_checker) {
+  return MutableRef<T, Checker, Policy>::try_borrow_mut(data, borrow_checker);
+}
+
+// The release token moves with the pointer, so a moved Ref still releases
+// through the handle it was given, and containers can relocate borrows
+// without asking the checker.
+static_assert(std::is_nothrow_move_constructible<Ref<int>>::value &&
+                  std::is_nothrow_move_assignable<Ref<int>>::value &&
+                  std::is_nothrow_move_constructible<MutableRef<int>>::value &&
+                  std::is_nothrow_move_assignable<MutableRef<int>>::value &&
+                  std::is_nothrow_move_constructible<Own<int>>::value &&
+                  std::is_nothrow_move_assignable<Own<int>>::value,
+              "checked wrappers must move without throwing");
+static_assert(
+    std::is_trivially_destructible<
+        Ref<int, BorrowChecker, CheckPolicy::None>>::value &&
+        std::is_trivially_destructible<
+            MutableRef<int, BorrowChecker, CheckPolicy::None>>::value,
+    "unchecked borrows must not do anything on destruction");
+
 void start_v2() {
   BorrowChecker borrow_checker;
   // Borrowing as immutable
@@ -190,10 +1118,9 @@ void start_v2() {
     Own<int> my_int(new int(42), &borrow_checker);
     MutableRef<int> data_mut_ref(my_int.get(), &borrow_checker);
     std::cout << "Data (mutable):" << *data_mut_ref << "\n";
-    try {
-      MutableRef<int> data_mut_ref(my_int.get(), &borrow_checker);
-    } catch (const std::runtime_error &e) {
-      std::cout << "Error: " << e.what() << "\n";
+    auto second = try_borrow_mut(my_int.get(), &borrow_checker);
+    if (!second) {
+      std::cout << "Error: " << second.error().message() << "\n";
     }
   }
 
@@ -202,16 +1129,42 @@ void start_v2() {
     {
       Own<int> my_int2(std::move(my_int));
       Ref<int> my_ref2(my_int2.get(), &borrow_checker);
-      try {
-        std::cout << "res: " << *my_ref2 << std::endl;
-      } catch (const std::runtime_error &e) {
-        std::cerr << e.what();
-      }
+      std::cout << "res: " << *my_ref2 << std::endl;
     }
-    try {
-      Ref<int> my_ref(my_int.get(), &borrow_checker);
-    } catch (const std::runtime_error &e) {
-      std::cerr << e.what();
+    auto my_ref = try_borrow(my_int.get(), &borrow_checker);
+    if (!my_ref) {
+      std::cerr << my_ref.error().message();
     }
   }
-}
\ No newline at end of file
+}
+
+} // namespace borrow
+
+// Global names for code written before namespace borrow; see borrow.h.
+#ifndef BORROW_NO_GLOBAL_NAMES
+using borrow::BorrowRecord;
+using borrow::held_borrow;
+using borrow::NodeStorage;
+using borrow::FlatStorage;
+using borrow::PmrStorage;
+using borrow::FixedStorage;
+using borrow::RefSet;
+using borrow::BasicBorrowChecker;
+using borrow::BorrowChecker;
+using borrow::FlatBorrowChecker;
+using borrow::PmrBorrowChecker;
+using borrow::Sendable;
+using borrow::Weak;
+using borrow::BorrowToken;
+using borrow::AllocatorDeleter;
+using borrow::Own;
+using borrow::InlineOwn;
+using borrow::make_own;
+using borrow::allocate_own;
+using borrow::Ref;
+using borrow::MutableRef;
+using borrow::try_borrow;
+using borrow::try_borrow_mut;
+using borrow::start_v2;
+namespace CheckPolicy = borrow::CheckPolicy;
+#endif
@@ -1,4 +1,11 @@
+#pragma once
+
 #include <array>
+#include <bit>
+#include <cassert>
+#include <concepts>
+#include <cstdint>
+#include <cstdlib>
 #include <type_traits>
 #include <utility>
 #include <tuple>
@@ -6,98 +13,600 @@
 #include <memory>
 #include <iostream>
 
-enum class BorrowState { Valid, Invalid, MutableBorrowed, Owned };
+#include "borrow_error.h"
+#include "borrow_result.h"
+#include "borrow_stats.h"
+#include "ptr_map.h"
+
+// Fixed-capacity generation of the checker. Its names live in namespace v3 so
+// it can be included next to v1.h and v2.h. Borrow states, conflicts and the
+// failure handler are the ones v2 uses: the constructors report a refused
+// borrow through fail_borrow(), and Ref::try_borrow, MutableRef::try_borrow_mut
+// and Own::try_borrow return it in a BorrowResult instead.
+namespace v3 {
+
+using borrow::BorrowConflict;
+using borrow::BorrowErrc;
+using borrow::BorrowResult;
+using borrow::BorrowState;
+
+// Borrow state of one tracked address packed into a single word: the low 30
+// bits count shared borrows, the top two bits flag an exclusive borrow and
+// ownership. Any number of Refs to the same address share one slot.
+struct BorrowRecord {
+  static constexpr std::uint32_t kMutable = 1u << 31;
+  static constexpr std::uint32_t kOwned = 1u << 30;
+  static constexpr std::uint32_t kShared = kOwned - 1;
+
+  std::uint32_t word = 0;
+
+  constexpr BorrowState state() const {
+    if (word & kMutable) {
+      return BorrowState::MutableBorrowed;
+    }
+    if (word & kOwned) {
+      return BorrowState::Owned;
+    }
+    return BorrowState::Valid;
+  }
+
+  constexpr std::uint32_t shared_count() const { return word & kShared; }
+
+  // Whether a new borrow of the given kind may be taken: an exclusive borrow
+  // needs an empty word, anything else just no exclusive borrow or owner.
+  constexpr bool allows(BorrowState state) const {
+    if (state == BorrowState::MutableBorrowed) {
+      return word == 0;
+    }
+    return (word & (kMutable | kOwned)) == 0;
+  }
+
+  constexpr void acquire(BorrowState state) {
+    switch (state) {
+    case BorrowState::Valid:
+      ++word;
+      break;
+    case BorrowState::MutableBorrowed:
+      word |= kMutable;
+      break;
+    case BorrowState::Owned:
+      word |= kOwned;
+      break;
+    case BorrowState::Invalid:
+      break;
+    }
+  }
+
+  constexpr void release(BorrowState state) {
+    switch (state) {
+    case BorrowState::Valid:
+      if (shared_count() != 0) {
+        --word;
+      }
+      break;
+    case BorrowState::MutableBorrowed:
+      word &= ~kMutable;
+      break;
+    case BorrowState::Owned:
+      word &= ~kOwned;
+      break;
+    case BorrowState::Invalid:
+      break;
+    }
+  }
+};
 
-template <std::size_t Size>
-struct BorrowCheckerStates {
-    std::array<BorrowState, Size> states{};
+// What BorrowChecker<T, N> does with a new address once all N inline slots
+// are taken: move it to a heap-allocated table, throw std::length_error, or
+// abort.
+enum class OverflowPolicy { Spill, Throw, Abort };
+
+// How BorrowChecker lays out its N inline slots. Split keeps addresses and
+// records in separate arrays, so the address scan in find reads nothing but
+// keys: 8 to a cache line instead of the 4 {address, record} pairs of
+// Interleaved, and a plain array of pointers for the vector compares.
+namespace SlotLayout {
+struct Interleaved {
+  template <std::size_t N> struct slots {
+    struct PtrState {
+      void *ptr;
+      BorrowRecord record;
+    };
+
+    std::array<PtrState, N> entries{};
+
+    constexpr void *ptr(std::size_t i) const { return entries[i].ptr; }
+    constexpr BorrowRecord &record(std::size_t i) { return entries[i].record; }
+    constexpr void assign(std::size_t i, void *ptr) { entries[i] = {ptr, {}}; }
+  };
+};
+
+struct Split {
+  template <std::size_t N> struct slots {
+    std::array<void *, N> ptrs{};
+    std::array<BorrowRecord, N> records{};
+
+    constexpr void *ptr(std::size_t i) const { return ptrs[i]; }
+    constexpr BorrowRecord &record(std::size_t i) { return records[i]; }
+    constexpr void assign(std::size_t i, void *ptr) {
+      ptrs[i] = ptr;
+      records[i] = {};
+    }
+  };
 };
+} // namespace SlotLayout
 
-template <typename T, std::size_t N>
+// Tracks up to N addresses inline; further addresses are handled according
+// to the OverflowPolicy given at construction.
+template <typename T, std::size_t N, typename Layout = SlotLayout::Split>
 class BorrowChecker {
 private:
-  struct PtrState {
-    void *ptr;
-    BorrowState state;
-  };
+  static_assert(N > 0, "BorrowChecker needs at least one slot");
+
+  static constexpr std::size_t kWords = (N + 63) / 64;
+  // Slot index meaning "no slot".
+  static constexpr std::size_t kNone = N;
+
+  typename Layout::template slots<N> slots_{};
+  // Bit i % 64 of occupied_[i / 64] is set while slot i is in use.
+  std::array<std::uint64_t, kWords> occupied_{};
+  OverflowPolicy overflow_;
+  std::size_t spills_ = 0;
+  // Addresses beyond the first N, allocated on the first overflow.
+  borrow::FlatPtrMap<BorrowRecord> *spill_ = nullptr;
+  [[no_unique_address]] borrow::BorrowStatsCounters stats_;
+
+  // Statistics are skipped during constant evaluation.
+  static constexpr bool counting() {
+    return borrow::BorrowStatsCounters::enabled &&
+           !std::is_constant_evaluated();
+  }
+
+  constexpr std::size_t live() const {
+    std::size_t live = spill_ == nullptr ? 0 : spill_->size();
+    for (std::uint64_t word : occupied_) {
+      live += std::popcount(word);
+    }
+    return live;
+  }
 
-  std::array<PtrState, N> borrow_map_{};
-
-  template <std::size_t... Is>
-  constexpr BorrowState check_borrow_impl(void *ptr,
-                                          std::index_sequence<Is...>) {
-    BorrowCheckerStates<N> states{};
-    (void)std::initializer_list<int>{(void(
-        (borrow_map_[Is].ptr == nullptr
-             ? states.states[Is] = BorrowState::Valid
-             : (borrow_map_[Is].ptr == ptr
-                    ? states.states[Is] = borrow_map_[Is].state
-                    : states.states[Is] = BorrowState::Valid))),
-                                      0)...};
-    for (BorrowState state : states.states) {
-      if (state != BorrowState::Valid) {
-        return state;
+  static constexpr std::uint64_t slot_bits(std::size_t word) {
+    std::size_t slots = N - word * 64;
+    return slots >= 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << slots) - 1;
+  }
+
+  // Compares ptr against a whole word's worth of slots without branching,
+  // which the compiler turns into vector compares, then picks the first
+  // occupied match.
+  constexpr std::size_t find(void *ptr) {
+    for (std::size_t word = 0; word < kWords; ++word) {
+      std::size_t base = word * 64;
+      std::size_t end = N - base < 64 ? N : base + 64;
+      std::uint64_t match = 0;
+      for (std::size_t i = base; i < end; ++i) {
+        match |= std::uint64_t{slots_.ptr(i) == ptr} << (i - base);
+      }
+      match &= occupied_[word];
+      if (match != 0) {
+        if (counting()) {
+          stats_.on_probe(end);
+        }
+        return base + std::countr_zero(match);
       }
     }
-    return BorrowState::Valid;
+    if (counting()) {
+      stats_.on_probe(N);
+    }
+    return kNone;
+  }
+
+  constexpr std::size_t claim(void *ptr) {
+    for (std::size_t word = 0; word < kWords; ++word) {
+      std::uint64_t free = ~occupied_[word] & slot_bits(word);
+      if (free != 0) {
+        std::size_t bit = std::countr_zero(free);
+        occupied_[word] |= std::uint64_t{1} << bit;
+        std::size_t slot = word * 64 + bit;
+        slots_.assign(slot, ptr);
+        if (counting()) {
+          stats_.on_live(live());
+        }
+        return slot;
+      }
+    }
+    return kNone;
+  }
+
+  constexpr void release(std::size_t slot) {
+    occupied_[slot / 64] &= ~(std::uint64_t{1} << (slot % 64));
+    slots_.assign(slot, nullptr);
+  }
+
+  // Record for ptr in the inline slots or, failing that, the spill table.
+  constexpr BorrowRecord *record_of(void *ptr) {
+    std::size_t slot = find(ptr);
+    if (slot != kNone) {
+      return &slots_.record(slot);
+    }
+    if (spill_ != nullptr) {
+      return spill_->find(ptr);
+    }
+    return nullptr;
+  }
+
+  constexpr void drop(void *ptr) {
+    std::size_t slot = find(ptr);
+    if (slot != kNone) {
+      release(slot);
+    } else if (spill_ != nullptr) {
+      spill_->erase(ptr);
+    }
+  }
+
+  // Called when every inline slot is taken.
+  BorrowRecord &overflow(void *ptr) {
+    switch (overflow_) {
+    case OverflowPolicy::Spill:
+      break;
+    case OverflowPolicy::Throw:
+      borrow::borrow_error<std::length_error>(
+          "borrow checker capacity exceeded");
+    case OverflowPolicy::Abort:
+      std::abort();
+    }
+    if (spill_ == nullptr) {
+      spill_ = new borrow::FlatPtrMap<BorrowRecord>();
+    }
+    ++spills_;
+    BorrowRecord &record = spill_->insert(ptr, BorrowRecord{});
+    if (counting()) {
+      stats_.on_spill();
+      stats_.on_live(live());
+    }
+    return record;
   }
 
 public:
-  constexpr BorrowChecker() {}
+  constexpr explicit BorrowChecker(
+      OverflowPolicy overflow = OverflowPolicy::Spill)
+      : overflow_(overflow) {}
+
+  BorrowChecker(const BorrowChecker &) = delete;
+  BorrowChecker &operator=(const BorrowChecker &) = delete;
+
+  constexpr ~BorrowChecker() { delete spill_; }
 
   constexpr void add_borrow(void *ptr, BorrowState state) {
-    for (std::size_t i = 0; i < N; ++i) {
-      if (borrow_map_[i].ptr == nullptr) {
-        borrow_map_[i] = {ptr, state};
-        return;
+    if (counting()) {
+      stats_.on_add();
+    }
+    if (BorrowRecord *record = record_of(ptr)) {
+      record->acquire(state);
+      return;
+    }
+    std::size_t slot = claim(ptr);
+    if (slot != kNone) {
+      slots_.record(slot).acquire(state);
+      return;
+    }
+    overflow(ptr).acquire(state);
+  }
+
+  // Takes a borrow of the given kind unless it conflicts with the borrows
+  // already held on ptr; returns false on conflict.
+  constexpr bool try_add_borrow(void *ptr, BorrowState state) {
+    if (BorrowRecord *record = record_of(ptr)) {
+      if (!record->allows(state)) {
+        if (counting()) {
+          stats_.on_conflict(static_cast<std::size_t>(record->state()));
+        }
+        return false;
       }
+      if (counting()) {
+        stats_.on_add();
+      }
+      record->acquire(state);
+      return true;
     }
-    __builtin_unreachable();
+    add_borrow(ptr, state);
+    return true;
   }
 
-  constexpr void remove_borrow(void *ptr) {
-    for (std::size_t i = 0; i < N; ++i) {
-      if (borrow_map_[i].ptr == ptr) {
-        borrow_map_[i] = {nullptr, BorrowState::Valid};
-        return;
+  // Releases one borrow of the given kind, freeing the slot once the address
+  // has no borrows left.
+  constexpr void remove_borrow(void *ptr, BorrowState state) {
+    if (counting()) {
+      stats_.on_remove();
+    }
+    if (BorrowRecord *record = record_of(ptr)) {
+      record->release(state);
+      if (record->word == 0) {
+        drop(ptr);
       }
     }
   }
 
+  // Drops every borrow recorded for ptr.
+  constexpr void remove_borrow(void *ptr) {
+    if (counting()) {
+      stats_.on_remove();
+    }
+    drop(ptr);
+  }
+
   constexpr BorrowState check_borrow(void *ptr) {
-    return check_borrow_impl(ptr, std::make_index_sequence<N>{});
+    if (counting()) {
+      stats_.on_check();
+    }
+    BorrowRecord *record = record_of(ptr);
+    return record == nullptr ? BorrowState::Valid : record->state();
+  }
+
+  // The packed record for ptr; an untracked address reads as an empty word.
+  constexpr std::uint32_t borrow_word(void *ptr) {
+    BorrowRecord *record = record_of(ptr);
+    return record == nullptr ? 0 : record->word;
   }
 
   constexpr void set_owned(void *ptr) {
-    for (std::size_t i = 0; i < N; ++i) {
-      if (borrow_map_[i].ptr == ptr) {
-        borrow_map_[i].state = BorrowState::Owned;
-        return;
-      }
+    if (BorrowRecord *record = record_of(ptr)) {
+      record->acquire(BorrowState::Owned);
     }
   }
 
   constexpr bool check_owned(void *ptr) {
-    for (std::size_t i = 0; i < N; ++i) {
-      if (borrow_map_[i].ptr == ptr) {
-        return borrow_map_[i].state == BorrowState::Owned;
-      }
+    return (borrow_word(ptr) & BorrowRecord::kOwned) != 0;
+  }
+
+  // Number of addresses that did not fit inline and went to the spill table.
+  constexpr std::size_t spill_count() const { return spills_; }
+
+  // Counters gathered when built with BORROW_CHECKER_STATS; an all-zero
+  // snapshot with enabled == false otherwise.
+  borrow::BorrowStats stats() const { return stats_.snapshot(); }
+};
+
+// The checker stays usable in constant evaluation, in either layout.
+static_assert([] {
+  auto test = [](auto layout) {
+    BorrowChecker<int, 2, decltype(layout)> checker;
+    int a = 0;
+    int b = 0;
+    checker.add_borrow(&a, BorrowState::Valid);
+    checker.add_borrow(&b, BorrowState::MutableBorrowed);
+    checker.remove_borrow(&a, BorrowState::Valid);
+    checker.add_borrow(&a, BorrowState::Owned);
+    return checker.check_borrow(&b) == BorrowState::MutableBorrowed &&
+           checker.check_owned(&a);
+  };
+  return test(SlotLayout::Interleaved{}) && test(SlotLayout::Split{});
+}());
+
+static_assert(sizeof(SlotLayout::Split::slots<64>) ==
+                  64 * (sizeof(void *) + sizeof(BorrowRecord)),
+              "split slots carry no padding");
+
+
+// Type-state borrows: the borrow state of a StaticOwn is part of its type, so
+// conflicts are compile errors rather than exceptions and nothing is
+// recorded at runtime; a StaticOwn is a bare owning pointer. Every
+// transition consumes the owner and returns it with its new state:
+//
+//   StaticOwn<int> own(new int(42));
+//   auto [shared, ref] = std::move(own).borrow();   // Borrowed<1>
+//   auto unborrowed = std::move(shared).release(std::move(ref));
+//   auto [exclusive, mut] = std::move(unborrowed).borrow_mut();
+//   std::move(exclusive).borrow();  // error: no borrow() while MutBorrowed
+//
+// Only the count of outstanding borrows is tracked, not which borrow belongs
+// to which owner, so giving a StaticRef back to a different owner of the same
+// type is caught only by an assertion.
+namespace TypeState {
+struct Unborrowed {};
+template <std::size_t K> struct Borrowed {};
+struct MutBorrowed {};
+
+template <typename State> struct shared_count {};
+template <> struct shared_count<Unborrowed> {
+  static constexpr std::size_t value = 0;
+};
+template <std::size_t K> struct shared_count<Borrowed<K>> {
+  static constexpr std::size_t value = K;
+};
+
+// States in which the value may still be read through its owner.
+template <typename State>
+concept Readable = requires { shared_count<State>::value; };
+} // namespace TypeState
+
+template <typename T> class StaticRef;
+template <typename T> class StaticMutRef;
+
+template <typename T, typename State = TypeState::Unborrowed>
+class StaticOwn {
+private:
+  T *data_;
+
+  template <typename U, typename S> friend class StaticOwn;
+
+  struct Adopt {};
+
+  constexpr StaticOwn(Adopt, T *data) : data_(data) {}
+
+  template <typename Next> constexpr StaticOwn<T, Next> into() {
+    return StaticOwn<T, Next>(typename StaticOwn<T, Next>::Adopt{},
+                              std::exchange(data_, nullptr));
+  }
+
+public:
+  constexpr explicit StaticOwn(T *data)
+    requires std::same_as<State, TypeState::Unborrowed>
+      : data_(data) {}
+
+  StaticOwn(const StaticOwn &) = delete;
+  StaticOwn &operator=(const StaticOwn &) = delete;
+
+  constexpr StaticOwn(StaticOwn &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)) {}
+
+  constexpr ~StaticOwn() {
+    assert((data_ == nullptr ||
+            std::same_as<State, TypeState::Unborrowed>)); // make sure no
+                                                          // borrow outlives
+                                                          // the value
+    delete data_;
+  }
+
+  constexpr T &operator*() const
+    requires std::same_as<State, TypeState::Unborrowed>
+  {
+    return *data_;
+  }
+
+  constexpr const T &operator*() const
+    requires(TypeState::Readable<State> &&
+             !std::same_as<State, TypeState::Unborrowed>)
+  {
+    return *data_;
+  }
+
+  // One more shared borrow; not available while mutably borrowed.
+  constexpr auto borrow() &&
+    requires TypeState::Readable<State>
+  {
+    constexpr std::size_t k = TypeState::shared_count<State>::value;
+    T *data = data_;
+    return std::pair(into<TypeState::Borrowed<k + 1>>(), StaticRef<T>(data));
+  }
+
+  // The exclusive borrow; only available while nothing else is borrowed.
+  constexpr auto borrow_mut() &&
+    requires std::same_as<State, TypeState::Unborrowed>
+  {
+    T *data = data_;
+    return std::pair(into<TypeState::MutBorrowed>(), StaticMutRef<T>(data));
+  }
+
+  // Gives back one shared borrow.
+  constexpr auto release(StaticRef<T> &&ref) &&
+    requires(TypeState::shared_count<State>::value > 0)
+  {
+    assert(ref.data_ == data_); // make sure the borrow is of this value
+    ref.data_ = nullptr;
+    if constexpr (TypeState::shared_count<State>::value == 1) {
+      return into<TypeState::Unborrowed>();
+    } else {
+      return into<
+          TypeState::Borrowed<TypeState::shared_count<State>::value - 1>>();
     }
-    return false;
   }
+
+  // Gives back the exclusive borrow.
+  constexpr StaticOwn<T> release(StaticMutRef<T> &&ref) &&
+    requires std::same_as<State, TypeState::MutBorrowed>
+  {
+    assert(ref.data_ == data_); // make sure the borrow is of this value
+    ref.data_ = nullptr;
+    return into<TypeState::Unborrowed>();
+  }
+};
+
+template <typename T> class StaticRef {
+private:
+  const T *data_;
+
+  template <typename U, typename S> friend class StaticOwn;
+
+  constexpr explicit StaticRef(const T *data) : data_(data) {}
+
+public:
+  StaticRef(const StaticRef &) = delete;
+  StaticRef &operator=(const StaticRef &) = delete;
+
+  constexpr StaticRef(StaticRef &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)) {}
+
+  constexpr const T &operator*() const { return *data_; }
+  constexpr const T *operator->() const { return data_; }
 };
 
+template <typename T> class StaticMutRef {
+private:
+  T *data_;
+
+  template <typename U, typename S> friend class StaticOwn;
+
+  constexpr explicit StaticMutRef(T *data) : data_(data) {}
 
-template <typename T, std::size_t N>
+public:
+  StaticMutRef(const StaticMutRef &) = delete;
+  StaticMutRef &operator=(const StaticMutRef &) = delete;
+
+  constexpr StaticMutRef(StaticMutRef &&other) noexcept
+      : data_(std::exchange(other.data_, nullptr)) {}
+
+  constexpr T &operator*() const { return *data_; }
+  constexpr T *operator->() const { return data_; }
+};
+
+static_assert(sizeof(StaticOwn<int, TypeState::Borrowed<3>>) == sizeof(int *));
+static_assert(sizeof(StaticRef<int>) == sizeof(int *));
+
+// Conflicting borrows don't type-check.
+namespace TypeState {
+template <typename Owner>
+concept CanBorrow = requires(Owner own) { std::move(own).borrow(); };
+template <typename Owner>
+concept CanBorrowMut = requires(Owner own) { std::move(own).borrow_mut(); };
+template <typename Owner, typename Borrow>
+concept CanRelease = requires(Owner own, Borrow borrow) {
+  std::move(own).release(std::move(borrow));
+};
+} // namespace TypeState
+
+static_assert(TypeState::CanBorrow<StaticOwn<int, TypeState::Borrowed<1>>>);
+static_assert(!TypeState::CanBorrow<StaticOwn<int, TypeState::MutBorrowed>>);
+static_assert(!TypeState::CanBorrowMut<StaticOwn<int, TypeState::Borrowed<1>>>);
+static_assert(!TypeState::CanBorrowMut<StaticOwn<int, TypeState::MutBorrowed>>);
+static_assert(!TypeState::CanRelease<StaticOwn<int>, StaticRef<int>>);
+static_assert(!TypeState::CanRelease<StaticOwn<int, TypeState::Borrowed<1>>,
+                          StaticMutRef<int>>);
+
+// A full borrow cycle runs in constant evaluation.
+static_assert([] {
+  StaticOwn<int> own(new int(1));
+  auto [shared, first] = std::move(own).borrow();
+  auto [twice, second] = std::move(shared).borrow();
+  int sum = *first + *second + *twice;
+  auto once = std::move(twice).release(std::move(second));
+  auto unborrowed = std::move(once).release(std::move(first));
+  auto [exclusive, mut] = std::move(unborrowed).borrow_mut();
+  *mut = sum;
+  auto done = std::move(exclusive).release(std::move(mut));
+  return *done == 3;
+}());
+
+// Owning pointer to a tracked value, released with Deleter (delete by
+// default).
+template <typename T, std::size_t N, typename Deleter = std::default_delete<T>,
+          typename Layout = SlotLayout::Split>
 class Own {
 private:
   T *data_;
-  BorrowChecker<T, N> *borrow_checker_;
+  BorrowChecker<T, N, Layout> *borrow_checker_;
   bool is_owner_;
+  [[no_unique_address]] Deleter deleter_;
+
+  BorrowConflict conflict() const {
+    return {BorrowErrc::MutableWhileBorrowed,
+            borrow_checker_->check_borrow(data_)};
+  }
 
 public:
-  constexpr explicit Own(T *data, BorrowChecker<T, N> *borrow_checker)
-      : data_(data), borrow_checker_(borrow_checker), is_owner_(true) {}
+  constexpr explicit Own(T *data, BorrowChecker<T, N, Layout> *borrow_checker,
+                         Deleter deleter = Deleter())
+      : data_(data), borrow_checker_(borrow_checker), is_owner_(true),
+        deleter_(std::move(deleter)) {}
 
   constexpr Own(const Own &) = delete;
   constexpr Own &operator=(const Own &) = delete;
@@ -105,16 +614,22 @@ public:
   constexpr Own(Own &&other) noexcept
       : data_(std::exchange(other.data_, nullptr)),
         borrow_checker_(other.borrow_checker_),
-        is_owner_(other.is_owner_) {
+        is_owner_(other.is_owner_), deleter_(std::move(other.deleter_)) {
     other.is_owner_ = false;
   }
 
   constexpr Own &operator=(Own &&other) noexcept {
     if (this != &other) {
-      borrow_checker_->remove_borrow(data_);
+      if (is_owner_) {
+        borrow_checker_->remove_borrow(data_);
+        if (data_ != nullptr) {
+          deleter_(data_);
+        }
+      }
       data_ = std::exchange(other.data_, nullptr);
       borrow_checker_ = other.borrow_checker_;
       is_owner_ = other.is_owner_;
+      deleter_ = std::move(other.deleter_);
       other.is_owner_ = false;
     }
     return *this;
@@ -125,7 +640,9 @@ public:
   ~Own() {
     if (is_owner_) {
       borrow_checker_->remove_borrow(data_);
-      delete data_;
+      if (data_ != nullptr) {
+        deleter_(data_);
+      }
     }
   }
 
@@ -134,17 +651,26 @@ public:
   constexpr T &operator*() const { return *data_; }
 
   template <std::size_t M>
-  constexpr Own<T, M> borrow() {
-    if (borrow_checker_->check_borrow(data_) != BorrowState::Valid) {
-      throw std::logic_error("borrow of already borrowed data");
+  constexpr Own<T, M, Deleter, Layout> borrow() {
+    if (!borrow_checker_->try_add_borrow(data_, BorrowState::Owned)) {
+      borrow::fail_borrow(conflict());
     }
-    borrow_checker_->add_borrow(data_, BorrowState::Owned);
-    return Own<T, M>(data_, borrow_checker_);
+    return Own<T, M, Deleter, Layout>(data_, borrow_checker_, deleter_);
+  }
+
+  // As borrow(), but returns the conflict without going through the failure
+  // handler.
+  template <std::size_t M>
+  BorrowResult<Own<T, M, Deleter, Layout>> try_borrow() {
+    if (!borrow_checker_->try_add_borrow(data_, BorrowState::Owned)) {
+      return conflict();
+    }
+    return Own<T, M, Deleter, Layout>(data_, borrow_checker_, deleter_);
   }
 
   constexpr void set_owned() {
     if (borrow_checker_->check_borrow(data_) != BorrowState::Valid) {
-      throw std::logic_error("setting owned of borrowed data");
+      borrow::borrow_error<std::logic_error>("setting owned of borrowed data");
     }
     borrow_checker_->set_owned(data_);
     is_owner_ = true;
@@ -153,22 +679,57 @@ public:
   constexpr bool is_owner() const {
     return is_owner_ && borrow_checker_->check_owned(data_);
   }
+
+  // Hands the value over to compile-time checking and stops tracking it in
+  // the checker; this Own is left empty. Throws if the value is borrowed.
+  // StaticOwn frees with delete, so only for the default deleter.
+  constexpr StaticOwn<T> into_static()
+    requires std::same_as<Deleter, std::default_delete<T>>
+  {
+    if ((borrow_checker_->borrow_word(data_) & ~BorrowRecord::kOwned) != 0) {
+      borrow::borrow_error<std::logic_error>(
+          "cannot move a value while it is borrowed");
+    }
+    borrow_checker_->remove_borrow(data_);
+    is_owner_ = false;
+    return StaticOwn<T>(std::exchange(data_, nullptr));
+  }
 };
 
-template <typename T, size_t N>
+template <typename T, size_t N, typename Layout = SlotLayout::Split>
 class Ref {
 private:
+  struct Adopt {};
+
   T *data_;
-  BorrowChecker<T, N> *borrow_checker_;
+  BorrowChecker<T, N, Layout> *borrow_checker_;
+
+  constexpr Ref(T *data, BorrowChecker<T, N, Layout> *borrow_checker, Adopt)
+      : data_(data), borrow_checker_(borrow_checker) {}
+
+  // A shared borrow is refused by a mutable borrow or by ownership.
+  static BorrowConflict conflict(BorrowChecker<T, N, Layout> *borrow_checker,
+                                 T *data) {
+    return {BorrowErrc::SharedWhileMutable,
+            borrow_checker->check_borrow(data)};
+  }
 
 public:
-  constexpr explicit Ref(T *data, BorrowChecker<T, N> *borrow_checker)
+  constexpr explicit Ref(T *data, BorrowChecker<T, N, Layout> *borrow_checker)
       : data_(data), borrow_checker_(borrow_checker) {
-    BorrowState state = borrow_checker_->check_borrow(data_);
-    if (state != BorrowState::Valid) {
-      throw std::logic_error("Invalid borrow in Ref constructor");
+    if (!borrow_checker_->try_add_borrow(data_, BorrowState::Valid)) {
+      borrow::fail_borrow(conflict(borrow_checker_, data_));
     }
-    borrow_checker_->add_borrow(data_, BorrowState::Valid);
+  }
+
+  // Takes a shared borrow of data, or returns the conflict without going
+  // through the failure handler.
+  static BorrowResult<Ref> try_borrow(T *data,
+                                      BorrowChecker<T, N, Layout> *checker) {
+    if (!checker->try_add_borrow(data, BorrowState::Valid)) {
+      return conflict(checker, data);
+    }
+    return Ref(data, checker, Adopt{});
   }
 
   constexpr Ref(const Ref &) = delete;
@@ -178,9 +739,12 @@ public:
       : data_(std::exchange(other.data_, nullptr)),
         borrow_checker_(other.borrow_checker_) {}
 
+  // Frees this Ref's slot, then takes over other's; other is left empty.
   constexpr Ref &operator=(Ref &&other) noexcept {
     if (this != &other) {
-      borrow_checker_->remove_borrow(data_);
+      if (data_ != nullptr) {
+        borrow_checker_->remove_borrow(data_, BorrowState::Valid);
+      }
       data_ = std::exchange(other.data_, nullptr);
       borrow_checker_ = other.borrow_checker_;
     }
@@ -190,39 +754,95 @@ public:
   constexpr T &operator*() const { return *data_; }
   constexpr T *operator->() const { return data_; }
 
-  ~Ref() { borrow_checker_->remove_borrow(data_); }
+  constexpr ~Ref() {
+    if (data_ != nullptr) {
+      borrow_checker_->remove_borrow(data_, BorrowState::Valid);
+    }
+  }
 };
 
-template <typename T>
+template <typename T, typename Layout = SlotLayout::Split>
 class MutableRef {
 public:
-  constexpr MutableRef(T& object, BorrowChecker<T, 1>& checker) :
-    object_{object},
-    checker_{checker}
+  constexpr MutableRef(T& object, BorrowChecker<T, 1, Layout>& checker) :
+    object_{&object},
+    checker_{&checker}
   {
-    checker_.add_borrow(&object_, BorrowState::MutableBorrowed);
+    if (!checker_->try_add_borrow(object_, BorrowState::MutableBorrowed)) {
+      borrow::fail_borrow(conflict(checker, object));
+    }
+  }
+
+  // Takes the exclusive borrow of object, or returns the conflict without
+  // going through the failure handler.
+  static BorrowResult<MutableRef>
+  try_borrow_mut(T& object, BorrowChecker<T, 1, Layout>& checker) {
+    if (!checker.try_add_borrow(&object, BorrowState::MutableBorrowed)) {
+      return conflict(checker, object);
+    }
+    return MutableRef(object, checker, Adopt{});
   }
 
   MutableRef(MutableRef const&) = delete;
   MutableRef& operator=(MutableRef const&) = delete;
 
-  ~MutableRef() {
-    checker_.remove_borrow(&object_);
+  constexpr MutableRef(MutableRef&& other) noexcept :
+    object_{std::exchange(other.object_, nullptr)},
+    checker_{other.checker_}
+  {}
+
+  constexpr MutableRef& operator=(MutableRef&& other) noexcept {
+    if (this != &other) {
+      if (object_ != nullptr) {
+        checker_->remove_borrow(object_, BorrowState::MutableBorrowed);
+      }
+      object_ = std::exchange(other.object_, nullptr);
+      checker_ = other.checker_;
+    }
+    return *this;
+  }
+
+  constexpr ~MutableRef() {
+    if (object_ != nullptr) {
+      checker_->remove_borrow(object_, BorrowState::MutableBorrowed);
+    }
   }
 
   T& operator*() const {
-    return object_;
+    return *object_;
   }
 
   T* operator->() const {
-    return &object_;
+    return object_;
   }
 
 private:
-  T& object_;
-  BorrowChecker<T, 1>& checker_;
+  struct Adopt {};
+
+  T* object_;
+  BorrowChecker<T, 1, Layout>* checker_;
+
+  constexpr MutableRef(T& object, BorrowChecker<T, 1, Layout>& checker,
+                       Adopt) :
+    object_{&object},
+    checker_{&checker}
+  {}
+
+  static BorrowConflict conflict(BorrowChecker<T, 1, Layout>& checker,
+                                 T& object) {
+    return {BorrowErrc::MutableWhileBorrowed, checker.check_borrow(&object)};
+  }
 };
 
+// The wrappers find their slot again by address when they release it, so a
+// move only copies two pointers, even during constant evaluation.
+static_assert(std::is_nothrow_move_constructible_v<Ref<int, 4>> &&
+              std::is_nothrow_move_assignable_v<Ref<int, 4>> &&
+              std::is_nothrow_move_constructible_v<MutableRef<int>> &&
+              std::is_nothrow_move_assignable_v<MutableRef<int>> &&
+              std::is_nothrow_move_constructible_v<Own<int, 4>> &&
+              std::is_nothrow_move_assignable_v<Own<int, 4>>);
+
 void start_v3() {
   // Allocate an int and create a BorrowChecker to track borrows.
   auto borrow_checker = std::make_unique<BorrowChecker<int, 3>>();
@@ -256,5 +876,20 @@ void start_v3() {
   std::cout << *mutable_ref;
   
   // The following line is illegal, because we already have a mutable reference
-  MutableRef<int> other_mutable_ref(ptr1, checker);
-}
\ No newline at end of file
+  auto other_mutable_ref = MutableRef<int>::try_borrow_mut(ptr1, checker);
+  if (!other_mutable_ref) {
+    std::cout << "\nError: " << other_mutable_ref.error().message() << "\n";
+  }
+
+  // The same mistake caught at compile time: once the borrow state is in the
+  // type, a second borrow_mut() does not compile.
+  Own<int, 1> counted(new int(7), &checker);
+  StaticOwn<int> value = counted.into_static();
+  auto [exclusive, static_mut] = std::move(value).borrow_mut();
+  *static_mut += 1;
+  // auto [again, other_static_mut] = std::move(exclusive).borrow_mut();
+  auto released = std::move(exclusive).release(std::move(static_mut));
+  std::cout << "StaticOwn value: " << *released << "\n";
+}
+
+} // namespace v3